@@ -3,6 +3,23 @@
 #include <string.h>
 #include <errno.h>
 #include <malloc.h>
+#include <math.h>
+
+// SSE2 is the baseline of every x64 build and of MSVC x86 by default
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+  #include <emmintrin.h>
+  #define BSP_SSE2
+#endif
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <time.h>
+  #include <sys/stat.h>
+  #include <pthread.h>
+#endif
 
 #ifndef NULL
   #define NULL ((void *)0)
@@ -29,6 +46,21 @@
 #define LUMP_AREAPORTALS 18
 #define HEADER_LUMPS     19
 
+#define SURF_LIGHT     0x1 // texinfo_t flags
+#define SURF_SLICK     0x2
+#define SURF_SKY       0x4
+#define SURF_WARP      0x8
+#define SURF_TRANS33  0x10
+#define SURF_TRANS66  0x20
+#define SURF_FLOWING  0x40
+#define SURF_NODRAW   0x80
+
+#define CONTENTS_SOLID  0x1 // leaf_t/brush_t contents
+#define CONTENTS_WINDOW 0x2
+#define CONTENTS_LAVA   0x8
+#define CONTENTS_SLIME  0x10
+#define MASK_SOLID      (CONTENTS_SOLID|CONTENTS_WINDOW)
+
 //============================================
 // Basic BSP Structures
 //============================================
@@ -217,8 +249,135 @@ typedef struct {
   area_t        *areas;       // 17
   int            num_areaportals;
   areaportal_t  *areaportals; // 18
+
+  unsigned int   checksum;    // engine map checksum, computed while loading
+  unsigned int   crc32c;      // CRC32C of whole file
+
+  // Derived data, built on demand by the query routines.
+  int           *nodeparents;   // parent node of each node (-1 = root)
+  int           *leafparents;   // parent node of each leaf
+  int           *leafvisframes; // == visframe if leaf is in current PVS
+  int           *nodevisframes; // == visframe if any child leaf is
+  int           *facevisframes; // == faceframe once face is listed
+  int           *facescratch;   // unsorted visible faces
+  int           *texinfocounts; // counting sort buckets (num_texinfos+1)
+  unsigned char *pvsrow;        // decompressed PVS of viscluster
+  unsigned char *pvsmatrix;     // all PVS rows, rowstride bytes apart,
+  unsigned char *phsmatrix;     // all PHS rows, owned by the vis lump
+  int            rowstride;     // rowbytes rounded up to 16
+  int            visframe;
+  int            faceframe;
+  int            viscluster;    // cluster PVS was last marked for
+  struct surfinfo_s *surfinfos; // lightmap extents of each face
+
+  // Materials and draw order, see bsp_build_drawbatches()
+  int            nummaterials;
+  struct material_s *materials;
+  int           *texinfomaterials; // material of each texinfo
+  int            materialtablesize;
+  int           *materialtable;    // open addressed name hash, -1 = empty
+  int            numdrawfaces;     // drawable faces at start of drawfaces
+  int           *drawfaces;        // face numbers in batch order
+  int            numdrawbatches;
+  struct drawbatch_s *drawbatches;
+  int            numlightpages;
+  int           *facepages;        // lightmap page of each face, -1 = none
+  short        (*facelmcoords)[2]; // face lightmap s/t within its page
 } bsp_t;
 
+// Word used for whole-row PVS/PHS operations
+typedef unsigned long long visword_t;
+
+//===================================
+// View frustum (4 side planes, inward facing)
+//===================================
+typedef struct {
+  plane_t planes[4];
+  float   soa[4][4]; // normal x, y, z and dist of all 4 planes, for SSE
+} frustum_t;
+
+//===================================
+// Navigation graph of walkable floor faces
+//===================================
+typedef struct {
+  float origin[3]; // centroid of floor face
+  float mins[3];
+  float maxs[3];
+  int   face;
+  int   area;
+} navnode_t;
+
+typedef struct {
+  int        numnodes;
+  navnode_t *nodes;
+  int       *facenodes; // navnode of each face, -1 if not floor
+  int        numlinks;
+  int       *firstlink; // links of node n are firstlink[n]..firstlink[n+1]-1
+  int       *links;     // target navnode
+  float     *costs;     // distance between node origins
+} navgraph_t;
+
+// Per-searcher A* scratch, one per thread sharing a navgraph_t
+typedef struct {
+  float  f;
+  int    node;
+} navheap_t;
+
+typedef struct {
+  navgraph_t *graph;
+  float      *gscore;
+  int        *parent;
+  int        *stamps;   // == stamp*2 when opened, stamp*2+1 when closed
+  navheap_t  *heap;
+  int         stamp;
+} navsearch_t;
+
+typedef struct {
+  float  start[3];
+  float  goal[3];
+  int   *path;     // caller buffer for navnode path, start to goal
+  int    maxpath;
+  int    numpath;  // length of full path, -1 if unreachable
+  float  cost;
+} navquery_t;
+
+//===================================
+// Lightmap extents of a face (bsp_build_surfinfos)
+//===================================
+typedef struct surfinfo_s {
+  short texturemins[2]; // s/t of first lightmap sample
+  short extents[2];     // lightmap is (extents>>4)+1 samples across
+  short numstyles;
+  short lit;            // has lightmap samples in dlightdata
+} surfinfo_t;
+
+//===================================
+// Interned texture + draw flags (bsp_build_materials)
+//===================================
+typedef struct material_s {
+  char name[32];  // texture name (textures/*.wal)
+  int  flags;     // SURF_* flags that affect drawing
+  int  animnext;  // material of next animation frame, -1 = none
+  int  numframes; // length of animation chain
+} material_t;
+
+// Run of faces sharing material and lightmap page
+typedef struct drawbatch_s {
+  int material;
+  int lightpage; // -1 = no lightmap
+  int firstface; // index into drawfaces
+  int numfaces;
+} drawbatch_t;
+
+// Light sampled at grid corners for O(1) lookups
+typedef struct {
+  float   origin[3]; // world position of corner 0,0,0
+  float   cellsize;
+  int     size[3];   // corners along x, y, z
+  float (*colors)[3];
+  unsigned char *solid; // corner is in a solid leaf, not sampled
+} lightgrid_t;
+
 //==================================================
 //==================================================
 //==================================================
@@ -231,6 +390,102 @@ void *xdata;
   return xdata;
 }
 
+//==================================================
+// Seconds on a monotonic clock.
+//==================================================
+double bsp_seconds(void) {
+#ifdef _WIN32
+LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+#endif
+}
+
+//==================================================
+// Number of CPUs to spread work over.
+//==================================================
+#define BSP_MAXTHREADS 64
+
+int bsp_numthreads(void) {
+int n;
+#ifdef _WIN32
+SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  n = (int)info.dwNumberOfProcessors;
+#else
+  n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+  if (n < 1) n = 1;
+  if (n > BSP_MAXTHREADS) n = BSP_MAXTHREADS;
+  return n;
+}
+
+typedef void (*bsp_job_t)(void *arg);
+
+typedef struct {
+  bsp_job_t func;
+  void     *arg;
+} bsp_thread_t;
+
+#ifdef _WIN32
+static DWORD WINAPI bsp_thread_main(LPVOID p) {
+#else
+static void *bsp_thread_main(void *p) {
+#endif
+  ((bsp_thread_t *)p)->func(((bsp_thread_t *)p)->arg);
+  return 0;
+}
+
+//==================================================
+// Run func once per element of args (argsize bytes
+// each) on numthreads threads, and wait for all.
+//==================================================
+void bsp_run_threads(bsp_job_t func, void *args, int argsize, int numthreads) {
+bsp_thread_t jobs[BSP_MAXTHREADS];
+#ifdef _WIN32
+HANDLE threads[BSP_MAXTHREADS];
+#else
+pthread_t threads[BSP_MAXTHREADS];
+#endif
+int i, started[BSP_MAXTHREADS];
+
+  if (numthreads > BSP_MAXTHREADS) numthreads = BSP_MAXTHREADS;
+
+  // Thread 0 is the caller
+  for (i=1; i < numthreads; i++) {
+    jobs[i].func = func;
+    jobs[i].arg = (char *)args + i*argsize;
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, bsp_thread_main, &jobs[i], 0, NULL);
+    started[i] = threads[i] != NULL;
+#else
+    started[i] = !pthread_create(&threads[i], NULL, bsp_thread_main, &jobs[i]);
+#endif
+    // Could not start, do it here instead
+    if (!started[i]) func(jobs[i].arg); }
+
+  if (numthreads > 0) func(args);
+
+  for (i=1; i < numthreads; i++) {
+    if (!started[i]) continue;
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+}
+
 unsigned long getp;     // Location of pointer in buffer
 unsigned long numbytes; // Size of buffer (in bytes)
 unsigned char *buffer;  // Pointer to the buffered data.
@@ -243,6 +498,142 @@ void getmem(void *addr, unsigned long bytes) {
   getp += bytes;
 }
 
+//=====================================================
+//=========== PROCESS-WIDE SHARED LUMP CACHE ==========
+//=====================================================
+
+// Lump copy shared by every loaded map with identical bytes.
+// Shared lumps are read-only, data follows this header.
+typedef struct lumpcache_s {
+  struct lumpcache_s *next;
+  unsigned long long  hash;
+  int                 filelen; // bytes copied from file
+  unsigned long       size;    // bytes allocated for data
+  int                 refs;
+  void               *derived[2]; // data built from lump, freed with it
+} lumpcache_t;
+
+#define LUMPCACHE_HASHSIZE 256
+
+lumpcache_t *lumpcache[LUMPCACHE_HASHSIZE];
+
+unsigned long lumpcache_lookups;   // lumps acquired
+unsigned long lumpcache_hits;      // lumps shared with an earlier map
+double        lumpcache_saved;     // bytes not allocated thanks to sharing
+double        lumpcache_resident;  // bytes held by the cache
+
+//==================================================
+// 64 bit hash of bytes, 8 bytes per step.
+//==================================================
+unsigned long long hash_bytes(const unsigned char *p, unsigned long len) {
+unsigned long long h, w;
+
+  h = 0xcbf29ce484222325ULL ^ len;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29; }
+
+  for (; len; p++, len--)
+    h = (h ^ *p) * 0x100000001b3ULL;
+
+  h ^= h >> 32;
+  return h;
+}
+
+//==================================================
+// Return shared copy of lump from buffer, size bytes
+// long (zero padded past filelen). Caller must treat it
+// as read-only and pass it to lump_release() when done.
+//==================================================
+void *lump_acquire(int lump, unsigned long size) {
+lumpcache_t *c;
+unsigned char *src;
+unsigned long long hash;
+int fileofs, filelen, b;
+
+  filelen = header.lumps[lump].filelen;
+  fileofs = header.lumps[lump].fileofs;
+
+  // Lump must lie inside the file, else treat as empty
+  if (fileofs < 0 || filelen < 0 || (unsigned long)fileofs > numbytes ||
+      (unsigned long)filelen > numbytes - fileofs) {
+    fileofs = 0;
+    filelen = 0; }
+  if ((unsigned long)filelen > size) filelen = size;
+
+  src = buffer + fileofs;
+  hash = hash_bytes(src, filelen);
+  b = (int)(hash % LUMPCACHE_HASHSIZE);
+
+  lumpcache_lookups++;
+
+  // Identical bytes already resident?
+  for (c = lumpcache[b]; c; c = c->next) {
+    if (c->hash != hash || c->filelen != filelen || c->size != size) continue;
+    if (memcmp(c+1, src, filelen)) continue;
+    c->refs++;
+    lumpcache_hits++;
+    lumpcache_saved += size;
+    return (void *)(c+1); }
+
+  c = (lumpcache_t *)xmalloc(sizeof(lumpcache_t) + size);
+  c->hash = hash;
+  c->filelen = filelen;
+  c->size = size;
+  c->refs = 1;
+  c->derived[0] = c->derived[1] = NULL;
+  memcpy(c+1, src, filelen);
+  memset((unsigned char *)(c+1) + filelen, 0, size - filelen);
+
+  c->next = lumpcache[b];
+  lumpcache[b] = c;
+  lumpcache_resident += size;
+
+  return (void *)(c+1);
+}
+
+//==================================================
+// Drop a reference to lump data from lump_acquire().
+//==================================================
+void lump_release(void *data) {
+lumpcache_t *c, **prev;
+
+  if (!data) return;
+
+  c = (lumpcache_t *)data - 1;
+  if (--c->refs > 0) return;
+
+  for (prev = &lumpcache[c->hash % LUMPCACHE_HASHSIZE]; *prev; prev = &(*prev)->next) {
+    if (*prev == c) {
+      *prev = c->next;
+      break; } }
+
+  lumpcache_resident -= c->size;
+  free(c->derived[0]);
+  free(c->derived[1]);
+  free(c);
+}
+
+//==================================================
+// Slots for data derived from a shared lump, so maps
+// sharing the lump share it too. Owned by the lump.
+//==================================================
+void **lump_derived(void *data) {
+  return ((lumpcache_t *)data - 1)->derived;
+}
+
+//==================================================
+// Print lump sharing statistics.
+//==================================================
+void lumpcache_stats(void) {
+  printf("lump cache: %lu lookups, %lu shared (%.1f%%), %.0f bytes saved, %.0f bytes resident\n",
+    lumpcache_lookups, lumpcache_hits,
+    lumpcache_lookups ? 100.0*lumpcache_hits/lumpcache_lookups : 0.0,
+    lumpcache_saved, lumpcache_resident);
+}
+
 //=====================================================
 //========= ROUTINES FOR READING BSP STRUCTS ==========
 //=====================================================
@@ -252,10 +643,6 @@ void getmem(void *addr, unsigned long bytes) {
 //=====================================================
 static entdata_t *readentdatas(bsp_t *map) {
 entdata_t *entdatas;
-int i;
-
-  // Set GET pointer to start of entdata_t data
-  getp = header.lumps[LUMP_ENTITIES].fileofs;
 
   // How many entdatas chars are there?
   map->num_entdatas = header.lumps[LUMP_ENTITIES].filelen;
@@ -264,12 +651,8 @@ int i;
 
   if (map->num_entdatas <= 0) return NULL;
 
-  // Allocate 1 entdata_t structure
-  entdatas = (entdata_t *)xmalloc(sizeof(entdata_t));
-
-  // Sequentially read entdata_t chars from buffer
-  for(i=0; i < map->num_entdatas; i++)
-    getmem((void *)&entdatas->dentdata[i],sizeof(entdatas->dentdata[i]));
+  // Share 1 entdata_t structure
+  entdatas = (entdata_t *)lump_acquire(LUMP_ENTITIES, sizeof(entdata_t));
 
   return entdatas;
 }
@@ -279,10 +662,6 @@ int i;
 //=====================================================
 static plane_t *readplanes(bsp_t *map) {
 plane_t *planes;
-int i;
-
-  // Set GET pointer to start of plane_t data
-  getp = header.lumps[LUMP_PLANES].fileofs;
 
   // How many planes records are there?
   map->num_planes = header.lumps[LUMP_PLANES].filelen/sizeof(plane_t);
@@ -291,12 +670,8 @@ int i;
 
   if (map->num_planes <= 0) return NULL;
 
-  // Allocate all plane_t structures for num_planes
-  planes = (plane_t *)xmalloc(map->num_planes*sizeof(plane_t));
-
-  // Sequentially read plane_t structs from buffer
-  for(i=0; i < map->num_planes; i++)
-    getmem((void *)&planes[i],sizeof(plane_t));
+  // Share all plane_t structures for num_planes
+  planes = (plane_t *)lump_acquire(LUMP_PLANES, map->num_planes*sizeof(plane_t));
 
   return planes;
 }
@@ -306,10 +681,6 @@ int i;
 //=====================================================
 static vertex_t *readvertexs(bsp_t *map) {
 vertex_t *vertexs;
-int i;
-
-  // Set GET pointer to start of vertex_t data
-  getp = header.lumps[LUMP_VERTEXES].fileofs;
 
   // How many vertexs records are there?
   map->num_vertexs = header.lumps[LUMP_VERTEXES].filelen/sizeof(vertex_t);
@@ -318,12 +689,8 @@ int i;
 
   if (map->num_vertexs <= 0) return NULL;
 
-  // Allocate all vertex_t structures for num_vertexs
-  vertexs = (vertex_t *)xmalloc(map->num_vertexs*sizeof(vertex_t));
-
-  // Sequentially read vertex_t structs from buffer
-  for(i=0; i < map->num_vertexs; i++)
-    getmem((void *)&vertexs[i],sizeof(vertex_t));
+  // Share all vertex_t structures for num_vertexs
+  vertexs = (vertex_t *)lump_acquire(LUMP_VERTEXES, map->num_vertexs*sizeof(vertex_t));
 
   return vertexs;
 }
@@ -335,22 +702,17 @@ static vis_t *readviss(bsp_t *map) {
 vis_t *viss;
 int i;
 
-  // Set GET pointer to start of vis_t data
-  getp = header.lumps[LUMP_VISIBILITY].fileofs;
-
-  // How many vis_t records are there?
-  map->num_viss = header.lumps[LUMP_VISIBILITY].filelen/sizeof(vis_t);
+  // How many vis bytes are there? The lump is a vis_t header
+  // followed by the compressed PVS/PHS rows, so keep it whole.
+  map->num_viss = header.lumps[LUMP_VISIBILITY].filelen;
 
   printf("vis count=%d\n",map->num_viss);
 
   if (map->num_viss <= 0) return NULL;
 
-  // Allocate all vis_t structures for num_viss
-  viss = (vis_t *)xmalloc(map->num_viss*sizeof(vis_t));
-
-  // Sequentially read vis_t structs from buffer
-  for(i=0; i < map->num_viss; i++)
-    getmem((void *)&viss[i],sizeof(vis_t));
+  // Share entire vis lump, at least 1 vis_t structure
+  i = map->num_viss < (int)sizeof(vis_t) ? (int)sizeof(vis_t) : map->num_viss;
+  viss = (vis_t *)lump_acquire(LUMP_VISIBILITY, i);
 
   return viss;
 }
@@ -360,10 +722,6 @@ int i;
 //=====================================================
 static node_t *readnodes(bsp_t *map) {
 node_t *nodes;
-int i;
-
-  // Set GET pointer to start of node_t data
-  getp = header.lumps[LUMP_NODES].fileofs;
 
   // How many nodes records are there?
   map->num_nodes = header.lumps[LUMP_NODES].filelen/sizeof(node_t);
@@ -372,12 +730,8 @@ int i;
 
   if (map->num_nodes <= 0) return NULL;
 
-  // Allocate all node_t structures for num_nodes
-  nodes = (node_t *)xmalloc(map->num_nodes*sizeof(node_t));
-
-  // Sequentially read node_t structs from buffer
-  for(i=0; i < map->num_nodes; i++)
-    getmem((void *)&nodes[i],sizeof(node_t));
+  // Share all node_t structures for num_nodes
+  nodes = (node_t *)lump_acquire(LUMP_NODES, map->num_nodes*sizeof(node_t));
 
   return nodes;
 }
@@ -387,10 +741,6 @@ int i;
 //=====================================================
 static texinfo_t *readtexinfos(bsp_t *map) {
 texinfo_t *texinfos;
-int i;
-
-  // Set GET pointer to start of texinfo_t data
-  getp = header.lumps[LUMP_TEXINFO].fileofs;
 
   // How many texinfos records are there?
   map->num_texinfos = header.lumps[LUMP_TEXINFO].filelen/sizeof(texinfo_t);
@@ -399,12 +749,8 @@ int i;
 
   if (map->num_texinfos <= 0) return NULL;
 
-  // Allocate all texinfo_t structures for num_texinfos
-  texinfos = (texinfo_t *)xmalloc(map->num_texinfos*sizeof(texinfo_t));
-
-  // Sequentially read texinfo_t structs from buffer
-  for(i=0; i < map->num_texinfos; i++)
-    getmem((void *)&texinfos[i],sizeof(texinfo_t));
+  // Share all texinfo_t structures for num_texinfos
+  texinfos = (texinfo_t *)lump_acquire(LUMP_TEXINFO, map->num_texinfos*sizeof(texinfo_t));
 
   return texinfos;
 }
@@ -414,10 +760,6 @@ int i;
 //=====================================================
 static face_t *readfaces(bsp_t *map) {
 face_t *faces;
-int i;
-
-  // Set GET pointer to start of face_t data
-  getp = header.lumps[LUMP_FACES].fileofs;
 
   // How many faces records are there?
   map->num_faces = header.lumps[LUMP_FACES].filelen/sizeof(face_t);
@@ -426,12 +768,8 @@ int i;
 
   if (map->num_faces <= 0) return NULL;
 
-  // Allocate all face_t structures for num_faces
-  faces = (face_t *)xmalloc(map->num_faces*sizeof(face_t));
-
-  // Sequentially read face_t structs from buffer
-  for(i=0; i < map->num_faces; i++)
-    getmem((void *)&faces[i],sizeof(face_t));
+  // Share all face_t structures for num_faces
+  faces = (face_t *)lump_acquire(LUMP_FACES, map->num_faces*sizeof(face_t));
 
   return faces;
 }
@@ -441,10 +779,6 @@ int i;
 //=====================================================
 static lightdata_t *readlightdatas(bsp_t *map) {
 lightdata_t *lightdatas;
-int i;
-
-  // Set GET pointer to start of lightdata_t data
-  getp = header.lumps[LUMP_LIGHTING].fileofs;
 
   // How many lightdatas chars are there?
   map->num_lightdatas = header.lumps[LUMP_LIGHTING].filelen;
@@ -453,12 +787,8 @@ int i;
 
   if (map->num_lightdatas <= 0) return NULL;
 
-  // Allocate 1 lightdata structure
-  lightdatas = (lightdata_t *)xmalloc(sizeof(lightdata_t));
-
-  // Sequentially read lightdata bytes from buffer
-  for(i=0; i < map->num_lightdatas; i++)
-    getmem((void *)&lightdatas->dlightdata[i],sizeof(lightdatas->dlightdata[i]));
+  // Share 1 lightdata structure
+  lightdatas = (lightdata_t *)lump_acquire(LUMP_LIGHTING, sizeof(lightdata_t));
 
   return lightdatas;
 }
@@ -468,10 +798,6 @@ int i;
 //=====================================================
 static leaf_t *readleafs(bsp_t *map) {
 leaf_t *leafs;
-int i;
-
-  // Set GET pointer to start of leaf_t data
-  getp = header.lumps[LUMP_LEAFS].fileofs;
 
   // How many leafs records are there?
   map->num_leafs = header.lumps[LUMP_LEAFS].filelen/sizeof(leaf_t);
@@ -480,12 +806,8 @@ int i;
 
   if (map->num_leafs <= 0) return NULL;
 
-  // Allocate all leaf_t structures for num_leafs
-  leafs = (leaf_t *)xmalloc(map->num_leafs*sizeof(leaf_t));
-
-  // Sequentially read leaf_t structs from buffer
-  for(i=0; i < map->num_leafs; i++)
-    getmem((void *)&leafs[i],sizeof(leaf_t));
+  // Share all leaf_t structures for num_leafs
+  leafs = (leaf_t *)lump_acquire(LUMP_LEAFS, map->num_leafs*sizeof(leaf_t));
 
   return leafs;
 }
@@ -495,10 +817,6 @@ int i;
 //=====================================================
 static leaffaces_t *readleaffaces(bsp_t *map) {
 leaffaces_t *leaffaces;
-int i;
-
-  // Set GET pointer to start of leafface_t data
-  getp = header.lumps[LUMP_LEAFFACES].fileofs;
 
   // How many leaffaces are there?
   map->num_leaffaces = header.lumps[LUMP_LEAFFACES].filelen;
@@ -507,12 +825,8 @@ int i;
 
   if (map->num_leaffaces <= 0) return NULL;
 
-  // Allocate 1 leaffaces structure
-  leaffaces = (leaffaces_t *)xmalloc(sizeof(leaffaces_t));
-
-  // Sequentially read leafface bytes from buffer
-  for(i=0; i < map->num_leaffaces; i++)
-    getmem((void *)&leaffaces->dleaffaces[i],sizeof(leaffaces->dleaffaces[i]));
+  // Share 1 leaffaces structure
+  leaffaces = (leaffaces_t *)lump_acquire(LUMP_LEAFFACES, sizeof(leaffaces_t));
 
   return leaffaces;
 }
@@ -522,10 +836,6 @@ int i;
 //=====================================================
 static leafbrushes_t *readleafbrushes(bsp_t *map) {
 leafbrushes_t *leafbrushes;
-int i;
-
-  // Set GET pointer to start of leafbrushes_t data
-  getp = header.lumps[LUMP_LEAFBRUSHES].fileofs;
 
   // How many leafbrushes are there?
   map->num_leafbrushes = header.lumps[LUMP_LEAFBRUSHES].filelen;
@@ -534,12 +844,8 @@ int i;
 
   if (map->num_leafbrushes <= 0) return NULL;
 
-  // Allocate 1 leafbrushes structure
-  leafbrushes = (leafbrushes_t *)xmalloc(sizeof(leafbrushes_t));
-
-  // Sequentially read leafbrushes bytes from buffer
-  for(i=0; i < map->num_leafbrushes; i++)
-    getmem((void *)&leafbrushes->dleafbrushes[i],sizeof(leafbrushes->dleafbrushes[i]));
+  // Share 1 leafbrushes structure
+  leafbrushes = (leafbrushes_t *)lump_acquire(LUMP_LEAFBRUSHES, sizeof(leafbrushes_t));
 
   return leafbrushes;
 }
@@ -549,10 +855,6 @@ int i;
 //=====================================================
 static edge_t *readedges(bsp_t *map) {
 edge_t *edges;
-int i;
-
-  // Set GET pointer to start of edge_t data
-  getp = header.lumps[LUMP_EDGES].fileofs;
 
   // How many edges records are there?
   map->num_edges = header.lumps[LUMP_EDGES].filelen/sizeof(edge_t);
@@ -561,12 +863,8 @@ int i;
 
   if (map->num_edges <= 0) return NULL;
 
-  // Allocate all edge_t structures for num_edges
-  edges = (edge_t *)xmalloc(map->num_edges*sizeof(edge_t));
-
-  // Sequentially read edge_t structs from buffer
-  for(i=0; i < map->num_edges; i++)
-    getmem((void *)&edges[i],sizeof(edge_t));
+  // Share all edge_t structures for num_edges
+  edges = (edge_t *)lump_acquire(LUMP_EDGES, map->num_edges*sizeof(edge_t));
 
   return edges;
 }
@@ -576,10 +874,6 @@ int i;
 //=====================================================
 static surfedges_t *readsurfedges(bsp_t *map) {
 surfedges_t *surfedges;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_SURFEDGES].fileofs;
 
   // How many surfedges are there?
   map->num_surfedges = header.lumps[LUMP_SURFEDGES].filelen;
@@ -588,12 +882,8 @@ int i;
 
   if (map->num_surfedges <= 0) return NULL;
 
-  // Allocate 1 surfedges structure
-  surfedges = (surfedges_t *)xmalloc(sizeof(surfedges_t));
-
-  // Sequentially read surfedges bytes from buffer
-  for(i=0; i < map->num_surfedges; i++)
-    getmem((void *)&surfedges->dsurfedges[i],sizeof(surfedges->dsurfedges[i]));
+  // Share 1 surfedges structure
+  surfedges = (surfedges_t *)lump_acquire(LUMP_SURFEDGES, sizeof(surfedges_t));
 
   return surfedges;
 }
@@ -603,10 +893,6 @@ int i;
 //=====================================================
 static model_t *readmodels(bsp_t *map) {
 model_t *models;
-int i;
-
-  // Set GET pointer to start of model_t data
-  getp = header.lumps[LUMP_MODELS].fileofs;
 
   // How many models records are there?
   map->num_models = header.lumps[LUMP_MODELS].filelen/sizeof(model_t);
@@ -615,12 +901,8 @@ int i;
 
   if (map->num_models <= 0) return NULL;
 
-  // Allocate all model_t structures for num_models
-  models = (model_t *)xmalloc(map->num_models*sizeof(model_t));
-
-  // Sequentially read model_t structs from buffer
-  for(i=0; i < map->num_models; i++)
-    getmem((void *)&models[i],sizeof(model_t));
+  // Share all model_t structures for num_models
+  models = (model_t *)lump_acquire(LUMP_MODELS, map->num_models*sizeof(model_t));
 
   return models;
 }
@@ -630,10 +912,6 @@ int i;
 //=====================================================
 static brush_t *readbrushes(bsp_t *map) {
 brush_t *brushes;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_BRUSHES].fileofs;
 
   // How many brushes records are there?
   map->num_brushes = header.lumps[LUMP_BRUSHES].filelen/sizeof(brush_t);
@@ -642,12 +920,8 @@ int i;
 
   if (map->num_brushes <= 0) return NULL;
 
-  // Allocate all brush_t structures for num_brushes
-  brushes = (brush_t *)xmalloc(map->num_brushes*sizeof(brush_t));
-
-  // Sequentially read brush_t structs from buffer
-  for(i=0; i < map->num_brushes; i++)
-    getmem((void *)&brushes[i],sizeof(brush_t));
+  // Share all brush_t structures for num_brushes
+  brushes = (brush_t *)lump_acquire(LUMP_BRUSHES, map->num_brushes*sizeof(brush_t));
 
   return brushes;
 }
@@ -657,10 +931,6 @@ int i;
 //=====================================================
 static brushside_t *readbrushsides(bsp_t *map) {
 brushside_t *brushsides;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_BRUSHSIDES].fileofs;
 
   // How many brushsides records are there?
   map->num_brushsides = header.lumps[LUMP_BRUSHSIDES].filelen/sizeof(brushside_t);
@@ -669,12 +939,8 @@ int i;
 
   if (map->num_brushsides <= 0) return NULL;
 
-  // Allocate all brushside_t structures for num_brushsides
-  brushsides = (brushside_t *)xmalloc(map->num_brushsides*sizeof(brushside_t));
-
-  // Sequentially read brushside_t structs from buffer
-  for(i=0; i < map->num_brushsides; i++)
-    getmem((void *)&brushsides[i],sizeof(brushside_t));
+  // Share all brushside_t structures for num_brushsides
+  brushsides = (brushside_t *)lump_acquire(LUMP_BRUSHSIDES, map->num_brushsides*sizeof(brushside_t));
 
   return brushsides;
 }
@@ -684,10 +950,6 @@ int i;
 //=====================================================
 static pop_t *readpops(bsp_t *map) {
 pop_t *pops;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_POP].fileofs;
 
   // How many pops chars are there?
   map->num_pops = header.lumps[LUMP_POP].filelen;
@@ -696,12 +958,8 @@ int i;
 
   if (map->num_pops <= 0) return NULL;
 
-  // Allocate 1 pop structure
-  pops = (pop_t *)xmalloc(sizeof(pop_t));
-
-  // Sequentially read pop bytes from buffer
-  for(i=0; i < map->num_pops; i++)
-    getmem((void *)&pops->dpop[i],sizeof(pops->dpop[i]));
+  // Share 1 pop structure
+  pops = (pop_t *)lump_acquire(LUMP_POP, sizeof(pop_t));
 
   return pops;
 }
@@ -711,10 +969,6 @@ int i;
 //=====================================================
 static area_t *readareas(bsp_t *map) {
 area_t *areas;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_AREAS].fileofs;
 
   // How many areas records are there?
   map->num_areas = header.lumps[LUMP_AREAS].filelen/sizeof(area_t);
@@ -723,12 +977,8 @@ int i;
 
   if (map->num_areas <= 0) return NULL;
 
-  // Allocate all area_t structures for num_areas
-  areas = (area_t *)xmalloc(map->num_areas*sizeof(area_t));
-
-  // Sequentially read area_t structs from buffer
-  for(i=0; i < map->num_areas; i++)
-    getmem((void *)&areas[i],sizeof(area_t));
+  // Share all area_t structures for num_areas
+  areas = (area_t *)lump_acquire(LUMP_AREAS, map->num_areas*sizeof(area_t));
 
   return areas;
 }
@@ -738,10 +988,6 @@ int i;
 //=====================================================
 static areaportal_t *readareaportals(bsp_t *map) {
 areaportal_t *areaportals;
-int i;
-
-  // Set GET pointer to start of surfedge_t data
-  getp = header.lumps[LUMP_AREAPORTALS].fileofs;
 
   // How many areaportal records are there?
   map->num_areaportals = header.lumps[LUMP_AREAPORTALS].filelen/sizeof(areaportal_t);
@@ -750,12 +996,8 @@ int i;
 
   if (map->num_areaportals <= 0) return NULL;
 
-  // Allocate all areaportal_t structures for num_areaportals
-  areaportals = (areaportal_t *)xmalloc(map->num_areaportals*sizeof(areaportal_t));
-
-  // Sequentially read areaportal_t structs from buffer
-  for(i=0; i < map->num_areaportals; i++)
-    getmem((void *)&areaportals[i],sizeof(areaportal_t));
+  // Share all areaportal_t structures for num_areaportals
+  areaportals = (areaportal_t *)lump_acquire(LUMP_AREAPORTALS, map->num_areaportals*sizeof(areaportal_t));
 
   return areaportals;
 }
@@ -767,10 +1009,12 @@ bsp_t *load_bsp_map(void) {
 bsp_t *map;
 
   // Read file header
+  getp = 0;
   getmem((void*)&header,sizeof(header_t));
 
   // Allocate bsp_t struct
   map = (bsp_t *)xmalloc(sizeof(bsp_t));
+  memset(map, 0, sizeof(bsp_t));
 
   // Load up entire map. Order not important.
   map->entdatas = readentdatas(map);
@@ -796,20 +1040,253 @@ bsp_t *map;
   return map;
 }
 
+//=====================================================
+//========= MAP CHECKSUMS, COMPUTED WHILE READING =====
+//=====================================================
+
+#define BSP_CHECKSUM_ENGINE 1 // Quake 2 Com_BlockChecksum (MD4)
+#define BSP_CHECKSUM_CRC32C 2 // Castagnoli CRC, SSE4.2 if available
+
+int bsp_checksums = BSP_CHECKSUM_ENGINE|BSP_CHECKSUM_CRC32C;
+
+#define BSP_READCHUNK 0x100000 // bytes read and checksummed per step
+
+typedef struct {
+  unsigned int  md4[4];
+  unsigned char block[64];   // partial MD4 block
+  unsigned long long length; // bytes so far
+  unsigned int  crc;
+} checksum_t;
+
+//==================================================
+// MD4 (RFC 1320) compression of one 64 byte block.
+//==================================================
+#define MD4_ROL(x,s) (((x) << (s)) | ((x) >> (32-(s))))
+#define MD4_F(x,y,z) (((x) & (y)) | (~(x) & (z)))
+#define MD4_G(x,y,z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MD4_H(x,y,z) ((x) ^ (y) ^ (z))
+
+static void md4_block(unsigned int state[4], const unsigned char *p) {
+static const int r2[16] = { 0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15 };
+static const int r3[16] = { 0,8,4,12, 2,10,6,14, 1,9,5,13, 3,11,7,15 };
+static const int s1[4] = { 3,7,11,19 }, s2[4] = { 3,5,9,13 }, s3[4] = { 3,9,11,15 };
+unsigned int x[16], a, b, c, d, t;
+int i;
+
+  for (i=0; i < 16; i++)
+    x[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) | ((unsigned int)p[i*4+3] << 24);
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+
+  for (i=0; i < 16; i++) {
+    t = a + MD4_F(b,c,d) + x[i];
+    a = d; d = c; c = b; b = MD4_ROL(t, s1[i&3]); }
+
+  for (i=0; i < 16; i++) {
+    t = a + MD4_G(b,c,d) + x[r2[i]] + 0x5a827999;
+    a = d; d = c; c = b; b = MD4_ROL(t, s2[i&3]); }
+
+  for (i=0; i < 16; i++) {
+    t = a + MD4_H(b,c,d) + x[r3[i]] + 0x6ed9eba1;
+    a = d; d = c; c = b; b = MD4_ROL(t, s3[i&3]); }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+
+//==================================================
+// CRC32C, hardware crc32 instruction when the CPU has
+// SSE4.2, else slicing-by-8 tables.
+//==================================================
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #include <intrin.h>
+  #include <nmmintrin.h>
+  #define CRC32C_HW
+  #define CRC32C_TARGET
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <cpuid.h>
+  #include <nmmintrin.h>
+  #define CRC32C_HW
+  #define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+
+static unsigned int crc32c_table[8][256];
+static int crc32c_hw = -1; // -1 until CPU checked
+
+static void crc32c_init(void) {
+unsigned int c;
+int i, j;
+#ifdef CRC32C_HW
+#ifdef _MSC_VER
+int info[4];
+#else
+unsigned int eax, ebx, ecx, edx;
+#endif
+#endif
+
+  for (i=0; i < 256; i++) {
+    c = i;
+    for (j=0; j < 8; j++)
+      c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+    crc32c_table[0][i] = c; }
+
+  for (i=0; i < 256; i++)
+    for (j=1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+
+  crc32c_hw = 0;
+#ifdef CRC32C_HW
+#ifdef _MSC_VER
+  __cpuid(info, 1);
+  crc32c_hw = (info[2] >> 20) & 1;
+#else
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    crc32c_hw = (ecx >> 20) & 1;
+#endif
+#endif
+}
+
+#ifdef CRC32C_HW
+CRC32C_TARGET static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, unsigned long len) {
+#if defined(_M_X64) || defined(__x86_64__)
+unsigned long long c = crc, w;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w); }
+  crc = (unsigned int)c;
+#else
+unsigned int w;
+
+  for (; len >= 4; p += 4, len -= 4) {
+    memcpy(&w, p, 4);
+    crc = _mm_crc32_u32(crc, w); }
+#endif
+
+  for (; len; p++, len--)
+    crc = _mm_crc32_u8(crc, *p);
+
+  return crc;
+}
+#endif
+
+static unsigned int crc32c_update(unsigned int crc, const unsigned char *p, unsigned long len) {
+unsigned int lo, hi;
+
+  if (crc32c_hw < 0) crc32c_init();
+
+#ifdef CRC32C_HW
+  if (crc32c_hw) return crc32c_sse42(crc, p, len);
+#endif
+
+  for (; len >= 8; p += 8, len -= 8) {
+    lo = (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24)) ^ crc;
+    hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24]; }
+
+  for (; len; p++, len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+
+  return crc;
+}
+
+//==================================================
+// Start checksums of a new file.
+//==================================================
+void checksum_init(checksum_t *cs) {
+  cs->md4[0] = 0x67452301;
+  cs->md4[1] = 0xefcdab89;
+  cs->md4[2] = 0x98badcfe;
+  cs->md4[3] = 0x10325476;
+  cs->length = 0;
+  cs->crc = 0xffffffff;
+}
+
+//==================================================
+// Feed bytes through MD4, buffering partial blocks.
+//==================================================
+static void md4_update(checksum_t *cs, const unsigned char *p, unsigned long len) {
+unsigned long have, n;
+
+  have = (unsigned long)(cs->length & 63);
+  cs->length += len;
+
+  // Top up partial block first
+  if (have) {
+    n = 64 - have < len ? 64 - have : len;
+    memcpy(cs->block + have, p, n);
+    p += n;
+    len -= n;
+    if (have + n < 64) return;
+    md4_block(cs->md4, cs->block); }
+
+  for (; len >= 64; p += 64, len -= 64)
+    md4_block(cs->md4, p);
+
+  memcpy(cs->block, p, len);
+}
+
+//==================================================
+// Add next len bytes of file, just after reading them
+// while they are still in cache.
+//==================================================
+void checksum_update(checksum_t *cs, const unsigned char *p, unsigned long len) {
+  if (bsp_checksums & BSP_CHECKSUM_CRC32C)
+    cs->crc = crc32c_update(cs->crc, p, len);
+
+  if (bsp_checksums & BSP_CHECKSUM_ENGINE)
+    md4_update(cs, p, len);
+  else
+    cs->length += len;
+}
+
+//==================================================
+// Finish checksums and store them in map.
+//==================================================
+void checksum_final(checksum_t *cs, bsp_t *map) {
+unsigned char pad[72];
+unsigned long long bits;
+int have, n, i;
+
+  map->crc32c = cs->crc ^ 0xffffffff;
+  map->checksum = 0;
+
+  if (!(bsp_checksums & BSP_CHECKSUM_ENGINE)) return;
+
+  // MD4 padding: 0x80, zeros, 64 bit little endian bit length
+  have = (int)(cs->length & 63);
+  n = have < 56 ? 56 - have : 120 - have;
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  bits = cs->length << 3;
+  for (i=0; i < 8; i++)
+    pad[n+i] = (unsigned char)(bits >> (i*8));
+
+  md4_update(cs, pad, n+8);
+
+  // Com_BlockChecksum folds the digest words together
+  map->checksum = cs->md4[0] ^ cs->md4[1] ^ cs->md4[2] ^ cs->md4[3];
+}
+
 //=================================================
 // Open BSP file at filepath and read buffer_t.
 //================================================
 bsp_t *loadbsp(char *filepath) {
+checksum_t cs;
+bsp_t *map;
 FILE *f;
-long bytesread;
+unsigned long bytesread, n;
 
   printf("\n\n%s\n",filepath);
 
   // Open filepath for read-only binary..
+  errno = 0;
   f = fopen(filepath, "rb");
   if (!f || errno) {
     fprintf(stderr, "fopen: %s\n", strerror(errno));
-    fclose(f);
+    if (f) fclose(f);
     return NULL; }
 
   // Move f pointer to EOF
@@ -826,8 +1303,14 @@ long bytesread;
 
   // Read ALL bytes from BSP file into buffer.
   // All operations done from buffer, not file.
-  // fread() extremely fast if reading entire file at once.
-  bytesread = fread(buffer, 1, numbytes, f);
+  // Large chunks keep fread() fast, and each chunk is
+  // checksummed while it is still in cache.
+  checksum_init(&cs);
+  for (bytesread = 0; bytesread < numbytes; bytesread += n) {
+    n = numbytes - bytesread < BSP_READCHUNK ? numbytes - bytesread : BSP_READCHUNK;
+    n = fread(buffer + bytesread, 1, n, f);
+    if (!n) break;
+    checksum_update(&cs, buffer + bytesread, n); }
 
   // ALL bytes read?
   if (bytesread != numbytes || errno) {
@@ -839,23 +1322,2337 @@ long bytesread;
   // Don't need file pointer any longer.
   fclose(f);
 
-  return load_bsp_map();
+  map = load_bsp_map();
+  checksum_final(&cs, map);
+
+  // Lumps are copied out, buffer no longer needed.
+  free(buffer);
+  buffer = NULL;
+
+  return map;
 }
 
-//================================================
-// Release the BSP map from memory..
-//================================================
-void bsp_free(bsp_t *map) {
-  free(map->leafs);
-  free(map->nodes);
-  free(map->planes);
-  free(map);
+//=====================================================
+//========= PIPELINED LOADING OF MANY MAPS ============
+//=====================================================
+
+#define BSP_PREFETCH 4 // map reads kept in flight ahead of decode
+
+// Called with each map in list order, map is NULL on failure.
+// Callback owns map and must bsp_free() it.
+typedef void (*bsp_loaded_t)(char *filepath, bsp_t *map, void *userdata);
+
+// One map file being read in the background.
+typedef struct {
+  char          *filepath;
+  unsigned char *data;       // NULL if read failed
+  unsigned long  size;
+  checksum_t     cs;
+#ifdef _WIN32
+  HANDLE         file;
+  OVERLAPPED    *ov;         // one per BSP_READCHUNK piece
+  int            numchunks;  // pieces queued
+#endif
+} bspread_t;
+
+#ifdef _WIN32
+//=================================================
+// Open filepath and queue overlapped reads of all its
+// BSP_READCHUNK pieces straight into the buffer.
+//=================================================
+static int bspread_start(bspread_t *r, char *filepath) {
+LARGE_INTEGER size;
+unsigned long ofs, len;
+int i, numchunks;
+
+  memset(r, 0, sizeof(bspread_t));
+  r->filepath = filepath;
+
+  r->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+    FILE_FLAG_OVERLAPPED|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (r->file == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "CreateFile: %s: error %lu\n", filepath, GetLastError());
+    return 0; }
+
+  if (!GetFileSizeEx(r->file, &size) || size.HighPart) {
+    CloseHandle(r->file);
+    r->file = INVALID_HANDLE_VALUE;
+    return 0; }
+
+  r->size = size.LowPart;
+  r->data = (unsigned char *)xmalloc(r->size+1);
+
+  numchunks = (int)((r->size + BSP_READCHUNK-1) / BSP_READCHUNK);
+  r->ov = (OVERLAPPED *)xmalloc((numchunks+1)*sizeof(OVERLAPPED));
+  memset(r->ov, 0, (numchunks+1)*sizeof(OVERLAPPED));
+
+  for (i=0; i < numchunks; i++) {
+    ofs = i*BSP_READCHUNK;
+    len = r->size - ofs < BSP_READCHUNK ? r->size - ofs : BSP_READCHUNK;
+    r->ov[i].Offset = ofs;
+    r->ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!ReadFile(r->file, r->data + ofs, (DWORD)len, NULL, &r->ov[i]) &&
+        GetLastError() != ERROR_IO_PENDING) {
+      fprintf(stderr, "ReadFile: %s: error %lu\n", filepath, GetLastError());
+      CloseHandle(r->ov[i].hEvent);
+      break; }
+
+    r->numchunks++; }
+
+  return 1;
 }
 
 //=================================================
-int main(int argc, char *argv[]) {
-char t;
-bsp_t *map;
+// Wait for the pieces of r in file order, checksumming
+// each one as soon as it has completed.
+//=================================================
+static int bspread_finish(bspread_t *r) {
+unsigned long bytesread, len;
+DWORD n;
+int i;
+
+  if (r->file == INVALID_HANDLE_VALUE || !r->data) return 0;
+
+  checksum_init(&r->cs);
+  bytesread = 0;
+
+  // Every queued piece must be waited on before the buffer is freed
+  for (i=0; i < r->numchunks; i++) {
+    len = r->size - r->ov[i].Offset < BSP_READCHUNK ? r->size - r->ov[i].Offset : BSP_READCHUNK;
+    if (!GetOverlappedResult(r->file, &r->ov[i], &n, TRUE)) n = 0;
+    CloseHandle(r->ov[i].hEvent);
+    if (n != len || bytesread != r->ov[i].Offset) continue;
+    checksum_update(&r->cs, r->data + bytesread, n);
+    bytesread += n; }
+
+  free(r->ov);
+  r->ov = NULL;
+  CloseHandle(r->file);
+  r->file = INVALID_HANDLE_VALUE;
+
+  if (bytesread != r->size) {
+    fprintf(stderr, "read: %s: short read\n", r->filepath);
+    free(r->data);
+    r->data = NULL;
+    return 0; }
+
+  return 1;
+}
+#else
+//=================================================
+// Read whole file into r, checksumming each chunk as
+// it arrives. Runs on the reader thread.
+//=================================================
+static int bspread_file(bspread_t *r, char *filepath) {
+struct stat st;
+unsigned long bytesread;
+long n;
+int fd;
+
+  memset(r, 0, sizeof(bspread_t));
+  r->filepath = filepath;
+
+  fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open: %s: %s\n", filepath, strerror(errno));
+    return 0; }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return 0; }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  r->size = st.st_size;
+  r->data = (unsigned char *)xmalloc(r->size+1);
+
+  checksum_init(&r->cs);
+  for (bytesread = 0; bytesread < r->size; bytesread += n) {
+    n = r->size - bytesread < BSP_READCHUNK ? r->size - bytesread : BSP_READCHUNK;
+    n = read(fd, r->data + bytesread, n);
+    if (n <= 0) break;
+    checksum_update(&r->cs, r->data + bytesread, n); }
+
+  close(fd);
+
+  if (bytesread != r->size) {
+    fprintf(stderr, "read: %s: short read\n", filepath);
+    free(r->data);
+    r->data = NULL;
+    return 0; }
+
+  return 1;
+}
+
+// Reader thread state, slots shared with the decoder.
+// File i always goes through slot i % BSP_PREFETCH, which
+// has its own reader thread.
+typedef struct {
+  char          **filepaths;
+  int             numfiles;
+  bspread_t       reads[BSP_PREFETCH];
+  int             slotfile[BSP_PREFETCH]; // file read into each slot, -1 = none yet
+  int             numdecoded;             // files taken out of slots
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} bspreader_t;
+
+typedef struct {
+  bspreader_t *rd;
+  int          slot;
+} bspreaderarg_t;
+
+//=================================================
+// Read every BSP_PREFETCH'th file into one slot, each
+// once the decoder has taken the previous one out, so
+// all slots have reads in flight at the same time.
+//=================================================
+static void *bspreader_main(void *arg) {
+bspreader_t *rd = ((bspreaderarg_t *)arg)->rd;
+int slot = ((bspreaderarg_t *)arg)->slot;
+int i;
+
+  for (i=slot; i < rd->numfiles; i += BSP_PREFETCH) {
+    pthread_mutex_lock(&rd->lock);
+    while (i - rd->numdecoded >= BSP_PREFETCH)
+      pthread_cond_wait(&rd->cond, &rd->lock);
+    pthread_mutex_unlock(&rd->lock);
+
+    bspread_file(&rd->reads[slot], rd->filepaths[i]);
+
+    pthread_mutex_lock(&rd->lock);
+    rd->slotfile[slot] = i;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock); }
+
+  return NULL;
+}
+#endif
+
+//=================================================
+// Decode a finished read. Takes ownership of its data.
+//=================================================
+static bsp_t *bspread_decode(bspread_t *r) {
+bsp_t *map;
+
+  if (!r->data) return NULL;
+
+  printf("\n\n%s\n",r->filepath);
+  buffer = r->data;
+  numbytes = r->size;
+  r->data = NULL;
+
+  map = load_bsp_map();
+  checksum_final(&r->cs, map);
+
+  free(buffer);
+  buffer = NULL;
+
+  return map;
+}
+
+//=================================================
+// Load numfiles maps, reading up to BSP_PREFETCH maps
+// ahead while each map is decoded: overlapped reads on
+// Windows, one reader thread per slot elsewhere, so on
+// either the next BSP_PREFETCH reads are in flight at
+// once. Returns number of maps loaded.
+//=================================================
+int loadbsp_pipeline(char **filepaths, int numfiles, bsp_loaded_t callback, void *userdata) {
+#ifdef _WIN32
+bspread_t reads[BSP_PREFETCH];
+bspread_t r;
+#else
+bspreaderarg_t args[BSP_PREFETCH];
+pthread_t readers[BSP_PREFETCH];
+int started[BSP_PREFETCH];
+bspreader_t *rd;
+bspread_t r;
+int slot;
+#endif
+bsp_t *map;
+int i, loaded;
+
+  loaded = 0;
+
+#ifdef _WIN32
+  for (i=0; i < numfiles && i < BSP_PREFETCH; i++)
+    bspread_start(&reads[i], filepaths[i]);
+
+  for (i=0; i < numfiles; i++) {
+    if (!bspread_finish(&reads[i % BSP_PREFETCH]))
+      reads[i % BSP_PREFETCH].data = NULL;
+    r = reads[i % BSP_PREFETCH];
+
+    // Slot is free, queue the next read before decoding
+    if (i + BSP_PREFETCH < numfiles)
+      bspread_start(&reads[i % BSP_PREFETCH], filepaths[i + BSP_PREFETCH]);
+
+    map = bspread_decode(&r);
+    if (map) loaded++;
+    callback(filepaths[i], map, userdata); }
+#else
+  rd = (bspreader_t *)xmalloc(sizeof(bspreader_t));
+  memset(rd, 0, sizeof(bspreader_t));
+  rd->filepaths = filepaths;
+  rd->numfiles = numfiles;
+  pthread_mutex_init(&rd->lock, NULL);
+  pthread_cond_init(&rd->cond, NULL);
+
+  for (slot=0; slot < BSP_PREFETCH; slot++) {
+    rd->slotfile[slot] = -1;
+    args[slot].rd = rd;
+    args[slot].slot = slot;
+    started[slot] = slot < numfiles && !pthread_create(&readers[slot], NULL, bspreader_main, &args[slot]); }
+
+  for (i=0; i < numfiles; i++) {
+    slot = i % BSP_PREFETCH;
+
+    // Slot's thread could not start, read it here instead
+    if (!started[slot]) bspread_file(&r, filepaths[i]);
+
+    pthread_mutex_lock(&rd->lock);
+    if (started[slot]) {
+      while (rd->slotfile[slot] != i)
+        pthread_cond_wait(&rd->cond, &rd->lock);
+      r = rd->reads[slot]; }
+    rd->numdecoded = i+1;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+
+    // Readers refill their slots while this map decodes
+    map = bspread_decode(&r);
+    if (map) loaded++;
+    callback(filepaths[i], map, userdata); }
+
+  for (slot=0; slot < BSP_PREFETCH; slot++)
+    if (started[slot]) pthread_join(readers[slot], NULL);
+  pthread_mutex_destroy(&rd->lock);
+  pthread_cond_destroy(&rd->cond);
+  free(rd);
+#endif
+
+  return loaded;
+}
+
+//=====================================================
+//============ ROUTINES FOR QUERYING A MAP =============
+//=====================================================
+
+#define DEG2RAD(a) ((a) * 0.017453292519943295f)
+#define DOTPRODUCT(a,b) ((a)[0]*(b)[0] + (a)[1]*(b)[1] + (a)[2]*(b)[2])
+
+//=====================================================
+// Number of clusters in the vis lump (0 if no vis).
+//=====================================================
+int bsp_numclusters(bsp_t *map) {
+  if (!map->vis || map->num_viss < (int)sizeof(int)) return 0;
+  return map->vis->numclusters;
+}
+
+//=====================================================
+// Bytes in one decompressed PVS/PHS row.
+//=====================================================
+int bsp_rowbytes(bsp_t *map) {
+  return (bsp_numclusters(map)+7)>>3;
+}
+
+//=====================================================
+// Find leaf containing point p by walking world nodes.
+// Unrecorded, see bsp_point_leaf() for the public query.
+//=====================================================
+static int point_leaf(bsp_t *map, const float p[3]) {
+plane_t *plane;
+float d;
+int num;
+
+  if (!map->nodes) return 0;
+
+  num = map->models ? map->models[0].headnode : 0;
+
+  while (num >= 0) {
+    plane = &map->planes[map->nodes[num].planenum];
+    if (plane->type < 3)
+      d = p[plane->type] - plane->dist;
+    else
+      d = DOTPRODUCT(p, plane->normal) - plane->dist;
+    num = map->nodes[num].child[d < 0]; }
+
+  return -1 - num;
+}
+
+//=====================================================
+// Decompress PVS (which=0) or PHS (which=1) row of
+// cluster into out. Invalid cluster = all visible.
+//=====================================================
+void bsp_decompress_vis(bsp_t *map, int cluster, int which, unsigned char *out) {
+unsigned char *in, *end;
+int *bitofs;
+int row, n, c;
+
+  row = bsp_rowbytes(map);
+
+  if (cluster < 0 || cluster >= bsp_numclusters(map)) {
+    memset(out, 0xff, row);
+    return; }
+
+  // bitofs[numclusters][2] follows numclusters in the lump
+  bitofs = (int *)map->vis + 1;
+  if (bitofs[cluster*2+which] <= 0 || bitofs[cluster*2+which] >= map->num_viss) {
+    memset(out, 0xff, row);
+    return; }
+
+  in = (unsigned char *)map->vis + bitofs[cluster*2+which];
+  end = (unsigned char *)map->vis + map->num_viss;
+
+  // Zero bytes are run-length encoded as 0,count
+  n = 0;
+  while (n < row && in < end) {
+    if (*in) {
+      out[n++] = *in++;
+      continue; }
+    c = in+1 < end ? in[1] : row;
+    in += 2;
+    if (n + c > row) c = row - n;
+    memset(out+n, 0, c);
+    n += c; }
+
+  // Truncated row, treat rest as visible
+  if (n < row) memset(out+n, 0xff, row-n);
+}
+
+//=====================================================
+// Build frustum side planes from view origin, axis
+// vectors and full horizontal/vertical fov in degrees.
+//=====================================================
+void bsp_set_frustum(frustum_t *frustum, const float origin[3],
+  const float forward[3], const float right[3], const float up[3],
+  float fov_x, float fov_y) {
+float sx, cx, sy, cy;
+int i;
+
+  sx = (float)sin(DEG2RAD(fov_x*0.5f));
+  cx = (float)cos(DEG2RAD(fov_x*0.5f));
+  sy = (float)sin(DEG2RAD(fov_y*0.5f));
+  cy = (float)cos(DEG2RAD(fov_y*0.5f));
+
+  for (i=0; i < 3; i++) {
+    frustum->planes[0].normal[i] = forward[i]*sx + right[i]*cx; // left
+    frustum->planes[1].normal[i] = forward[i]*sx - right[i]*cx; // right
+    frustum->planes[2].normal[i] = forward[i]*sy - up[i]*cy;    // top
+    frustum->planes[3].normal[i] = forward[i]*sy + up[i]*cy; }  // bottom
+
+  for (i=0; i < 4; i++) {
+    frustum->planes[i].dist = DOTPRODUCT(origin, frustum->planes[i].normal);
+    frustum->planes[i].type = 0;
+    frustum->soa[0][i] = frustum->planes[i].normal[0];
+    frustum->soa[1][i] = frustum->planes[i].normal[1];
+    frustum->soa[2][i] = frustum->planes[i].normal[2];
+    frustum->soa[3][i] = frustum->planes[i].dist; }
+}
+
+//=====================================================
+// Test box against the frustum planes still set in
+// clipflags. Returns -1 if culled, otherwise the
+// clipflags left after dropping planes the box is
+// fully inside of (children need not test those).
+//=====================================================
+static int box_clipflags(const frustum_t *frustum, int clipflags,
+  const short mins[3], const short maxs[3]) {
+#ifdef BSP_SSE2
+__m128 a, b, pmax, pmin, dist;
+
+  // n*min vs n*max per axis gives nearest and farthest
+  // corner of all 4 planes at once
+  a = _mm_mul_ps(_mm_loadu_ps(frustum->soa[0]), _mm_set1_ps(mins[0]));
+  b = _mm_mul_ps(_mm_loadu_ps(frustum->soa[0]), _mm_set1_ps(maxs[0]));
+  pmax = _mm_max_ps(a, b);
+  pmin = _mm_min_ps(a, b);
+
+  a = _mm_mul_ps(_mm_loadu_ps(frustum->soa[1]), _mm_set1_ps(mins[1]));
+  b = _mm_mul_ps(_mm_loadu_ps(frustum->soa[1]), _mm_set1_ps(maxs[1]));
+  pmax = _mm_add_ps(pmax, _mm_max_ps(a, b));
+  pmin = _mm_add_ps(pmin, _mm_min_ps(a, b));
+
+  a = _mm_mul_ps(_mm_loadu_ps(frustum->soa[2]), _mm_set1_ps(mins[2]));
+  b = _mm_mul_ps(_mm_loadu_ps(frustum->soa[2]), _mm_set1_ps(maxs[2]));
+  pmax = _mm_add_ps(pmax, _mm_max_ps(a, b));
+  pmin = _mm_add_ps(pmin, _mm_min_ps(a, b));
+
+  dist = _mm_loadu_ps(frustum->soa[3]);
+
+  if (_mm_movemask_ps(_mm_cmplt_ps(pmax, dist)) & clipflags) return -1;
+
+  return clipflags & ~_mm_movemask_ps(_mm_cmpge_ps(pmin, dist));
+#else
+const plane_t *p;
+float pmax, pmin;
+int i;
+
+  for (i=0; i < 4; i++) {
+    if (!(clipflags & (1<<i))) continue;
+    p = &frustum->planes[i];
+
+    // Most positive and most negative corner along normal
+    pmax = (p->normal[0] >= 0 ? maxs[0] : mins[0])*p->normal[0]
+         + (p->normal[1] >= 0 ? maxs[1] : mins[1])*p->normal[1]
+         + (p->normal[2] >= 0 ? maxs[2] : mins[2])*p->normal[2];
+    if (pmax < p->dist) return -1;
+
+    pmin = (p->normal[0] >= 0 ? mins[0] : maxs[0])*p->normal[0]
+         + (p->normal[1] >= 0 ? mins[1] : maxs[1])*p->normal[1]
+         + (p->normal[2] >= 0 ? mins[2] : maxs[2])*p->normal[2];
+    if (pmin >= p->dist) clipflags &= ~(1<<i); }
+
+  return clipflags;
+#endif
+}
+
+//=====================================================
+// Decompress every cluster's PVS row into pvsmatrix.
+// Rows are padded to 16 bytes for bsp_build_phs(). The
+// matrix hangs off the shared vis lump, so identical
+// maps loaded later reuse it.
+//=====================================================
+void bsp_build_pvs(bsp_t *map) {
+void **derived;
+int numclusters, i;
+
+  if (map->pvsmatrix) return;
+
+  numclusters = bsp_numclusters(map);
+  if (numclusters <= 0) return;
+
+  map->rowstride = (bsp_rowbytes(map)+15) & ~15;
+  derived = lump_derived(map->vis);
+  if (derived[0]) {
+    map->pvsmatrix = (unsigned char *)derived[0];
+    return; }
+
+  map->pvsmatrix = (unsigned char *)xmalloc(numclusters*map->rowstride);
+  memset(map->pvsmatrix, 0, numclusters*map->rowstride);
+
+  for (i=0; i < numclusters; i++)
+    bsp_decompress_vis(map, i, 0, map->pvsmatrix + i*map->rowstride);
+
+  derived[0] = map->pvsmatrix;
+}
+
+typedef struct {
+  bsp_t *map;
+  int    thread;
+  int    numthreads;
+} phsjob_t;
+
+//=====================================================
+// OR the PVS rows of everything row i sees into PHS
+// row i, for rows thread, thread+numthreads, ... Rows
+// are disjoint between threads so no locking needed.
+//=====================================================
+static void phs_rows(void *arg) {
+phsjob_t *job = (phsjob_t *)arg;
+bsp_t *map = job->map;
+unsigned char *pvs, *dst, *src;
+int numclusters, i, j, k, b, c;
+
+  numclusters = bsp_numclusters(map);
+
+  for (i = job->thread; i < numclusters; i += job->numthreads) {
+    pvs = map->pvsmatrix + i*map->rowstride;
+    dst = map->phsmatrix + i*map->rowstride;
+    for (j=0; j < bsp_rowbytes(map); j++) {
+      if (!pvs[j]) continue;
+      for (b=0; b < 8; b++) {
+        c = j*8+b;
+        if (!(pvs[j] & (1<<b)) || c == i || c >= numclusters) continue;
+        src = map->pvsmatrix + c*map->rowstride;
+#ifdef BSP_SSE2
+        for (k=0; k < map->rowstride; k += 16)
+          _mm_storeu_si128((__m128i *)(dst+k), _mm_or_si128(
+            _mm_loadu_si128((__m128i *)(dst+k)), _mm_loadu_si128((__m128i *)(src+k))));
+#else
+        for (k=0; k < map->rowstride; k += sizeof(visword_t))
+          *(visword_t *)(dst+k) |= *(visword_t *)(src+k);
+#endif
+      } } }
+}
+
+//=====================================================
+// Build potentially hearable set of every cluster: the
+// union of the PVS rows of all clusters in its PVS.
+// Rows are split over threads, each set bit ORs a
+// whole row 16 bytes at a time. Cached on the vis lump
+// like the PVS matrix.
+//=====================================================
+void bsp_build_phs(bsp_t *map) {
+phsjob_t jobs[BSP_MAXTHREADS];
+void **derived;
+int numclusters, numthreads, i;
+
+  if (map->phsmatrix) return;
+
+  bsp_build_pvs(map);
+  if (!map->pvsmatrix) return;
+
+  derived = lump_derived(map->vis);
+  if (derived[1]) {
+    map->phsmatrix = (unsigned char *)derived[1];
+    return; }
+
+  numclusters = bsp_numclusters(map);
+
+  // Every cluster hears at least what it sees
+  map->phsmatrix = (unsigned char *)xmalloc(numclusters*map->rowstride);
+  memcpy(map->phsmatrix, map->pvsmatrix, numclusters*map->rowstride);
+
+  // Small maps are not worth starting threads for
+  numthreads = bsp_numthreads();
+  if (numthreads > numclusters/64 + 1) numthreads = numclusters/64 + 1;
+
+  for (i=0; i < numthreads; i++) {
+    jobs[i].map = map;
+    jobs[i].thread = i;
+    jobs[i].numthreads = numthreads; }
+
+  bsp_run_threads(phs_rows, jobs, sizeof(phsjob_t), numthreads);
+
+  derived[1] = map->phsmatrix;
+}
+
+//=====================================================
+// PVS row of cluster, from pvsmatrix if built, else
+// decompressed into a scratch row (valid until next
+// call, not thread safe).
+//=====================================================
+unsigned char *bsp_cluster_pvs(bsp_t *map, int cluster) {
+  if (map->pvsmatrix && cluster >= 0 && cluster < bsp_numclusters(map))
+    return map->pvsmatrix + cluster*map->rowstride;
+
+  if (!map->pvsrow) map->pvsrow = (unsigned char *)xmalloc(bsp_rowbytes(map)+1);
+  bsp_decompress_vis(map, cluster, 0, map->pvsrow);
+  return map->pvsrow;
+}
+
+//=====================================================
+// PHS row of cluster, from phsmatrix if built, else the
+// compiler's PHS from the vis lump (valid until next call).
+//=====================================================
+unsigned char *bsp_cluster_phs(bsp_t *map, int cluster) {
+  if (map->phsmatrix && cluster >= 0 && cluster < bsp_numclusters(map))
+    return map->phsmatrix + cluster*map->rowstride;
+
+  if (!map->pvsrow) map->pvsrow = (unsigned char *)xmalloc(bsp_rowbytes(map)+1);
+  bsp_decompress_vis(map, cluster, 1, map->pvsrow);
+  return map->pvsrow;
+}
+
+//=====================================================
+// Is target set in the PVS (which 0) or PHS (which 1)
+// row of cluster? Walks the compressed row only as far
+// as the target byte, writes nothing, so thread safe.
+//=====================================================
+static int vis_test(bsp_t *map, int cluster, int which, int target) {
+unsigned char *in, *end;
+int *bitofs;
+int n;
+
+  if (cluster < 0 || cluster >= bsp_numclusters(map)) return 1;
+
+  bitofs = (int *)map->vis + 1;
+  if (bitofs[cluster*2+which] <= 0 || bitofs[cluster*2+which] >= map->num_viss) return 1;
+
+  in = (unsigned char *)map->vis + bitofs[cluster*2+which];
+  end = (unsigned char *)map->vis + map->num_viss;
+
+  // Skip whole bytes up to target, runs of zeros at once
+  n = 0;
+  while (in < end) {
+    if (*in) {
+      if (n == target>>3) return (*in >> (target&7)) & 1;
+      n++;
+      in++;
+      continue; }
+    n += in+1 < end ? in[1] : bsp_rowbytes(map);
+    if (n > target>>3) return 0;
+    in += 2; }
+
+  // Truncated row, treat rest as visible
+  return 1;
+}
+
+//=====================================================
+// Allocate tables used by bsp_visible_faces().
+//=====================================================
+static void bsp_init_visdata(bsp_t *map) {
+int i, n;
+
+  if (map->nodeparents) return;
+
+  map->nodeparents = (int *)xmalloc((map->num_nodes+1)*sizeof(int));
+  map->leafparents = (int *)xmalloc((map->num_leafs+1)*sizeof(int));
+  map->nodevisframes = (int *)xmalloc((map->num_nodes+1)*sizeof(int));
+  map->leafvisframes = (int *)xmalloc((map->num_leafs+1)*sizeof(int));
+  map->facevisframes = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  map->facescratch = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  map->texinfocounts = (int *)xmalloc((map->num_texinfos+1)*sizeof(int));
+
+  memset(map->nodevisframes, 0, (map->num_nodes+1)*sizeof(int));
+  memset(map->leafvisframes, 0, (map->num_leafs+1)*sizeof(int));
+  memset(map->facevisframes, 0, (map->num_faces+1)*sizeof(int));
+
+  // Disk format only stores children, so link parents
+  for (i=0; i < map->num_nodes; i++) map->nodeparents[i] = -1;
+  for (i=0; i < map->num_leafs; i++) map->leafparents[i] = -1;
+  for (i=0; i < map->num_nodes; i++) {
+    for (n=0; n < 2; n++) {
+      if (map->nodes[i].child[n] >= 0)
+        map->nodeparents[map->nodes[i].child[n]] = i;
+      else
+        map->leafparents[-1-map->nodes[i].child[n]] = i; } }
+
+  map->viscluster = -2;
+}
+
+//=====================================================
+// Mark leafs (and their parent nodes) in cluster's PVS.
+//=====================================================
+static void bsp_mark_leaves(bsp_t *map, int cluster) {
+unsigned char *pvs;
+int i, c, n;
+
+  // Same cluster as last query, marks still valid
+  if (cluster == map->viscluster) return;
+
+  map->viscluster = cluster;
+  map->visframe++;
+
+  pvs = bsp_cluster_pvs(map, cluster);
+
+  for (i=0; i < map->num_leafs; i++) {
+    // Solid leafs have no cluster, no vis means all visible
+    c = map->leafs[i].cluster;
+    if (c < 0) continue;
+    if (bsp_numclusters(map) &&
+       (c >= bsp_numclusters(map) || !(pvs[c>>3] & (1<<(c&7)))))
+      continue;
+
+    map->leafvisframes[i] = map->visframe;
+    for (n = map->leafparents[i]; n >= 0; n = map->nodeparents[n]) {
+      if (map->nodevisframes[n] == map->visframe) break;
+      map->nodevisframes[n] = map->visframe; } }
+}
+
+//=====================================================
+// Walk marked nodes front to back from origin, culling
+// node and leaf boxes against frustum, collecting leaf
+// faces (so each texinfo bucket is near to far too).
+//=====================================================
+static int bsp_collect_faces(bsp_t *map, const frustum_t *frustum, const float origin[3],
+  int num, int clipflags, int count) {
+node_t *node;
+leaf_t *leaf;
+plane_t *plane;
+int i, f, side;
+
+  while (num >= 0) {
+    node = &map->nodes[num];
+    if (map->nodevisframes[num] != map->visframe) return count;
+    if (clipflags) {
+      clipflags = box_clipflags(frustum, clipflags, node->mins, node->maxs);
+      if (clipflags < 0) return count; }
+
+    // Near side of the node plane first
+    plane = &map->planes[node->planenum];
+    if (plane->type < 3)
+      side = origin[plane->type] - plane->dist < 0;
+    else
+      side = DOTPRODUCT(origin, plane->normal) - plane->dist < 0;
+
+    count = bsp_collect_faces(map, frustum, origin, node->child[side], clipflags, count);
+    num = node->child[side^1]; }
+
+  num = -1 - num;
+  leaf = &map->leafs[num];
+  if (map->leafvisframes[num] != map->visframe) return count;
+  if (clipflags && box_clipflags(frustum, clipflags, leaf->mins, leaf->maxs) < 0)
+    return count;
+
+  for (i=0; i < leaf->numleaffaces; i++) {
+    f = map->leaffaces->dleaffaces[leaf->firstleafface+i];
+    if (f >= map->num_faces || map->facevisframes[f] == map->faceframe)
+      continue;
+    map->facevisframes[f] = map->faceframe;
+    map->facescratch[count++] = f; }
+
+  return count;
+}
+
+//=====================================================
+// Find all world faces visible from origin: PVS of the
+// viewer's cluster, then frustum culled node/leaf boxes.
+// Fills facelist (up to maxfaces) sorted by texinfo and
+// returns number of faces written.
+//=====================================================
+int bsp_visible_faces(bsp_t *map, const float origin[3],
+  const frustum_t *frustum, int *facelist, int maxfaces) {
+int *counts;
+int leaf, count, i, t, sum;
+
+  if (!map->nodes || !map->leafs || !map->faces || !map->leaffaces || !map->planes) return 0;
+
+  bsp_init_visdata(map);
+
+  leaf = point_leaf(map, origin);
+  bsp_mark_leaves(map, map->leafs[leaf].cluster);
+
+  map->faceframe++;
+  count = bsp_collect_faces(map, frustum, origin,
+    map->models ? map->models[0].headnode : 0, 15, 0);
+
+  // Counting sort by texinfo, one bucket per texinfo
+  counts = map->texinfocounts;
+  memset(counts, 0, (map->num_texinfos+1)*sizeof(int));
+  for (i=0; i < count; i++) {
+    t = map->faces[map->facescratch[i]].texinfo;
+    counts[(t >= 0 && t < map->num_texinfos) ? t : map->num_texinfos]++; }
+
+  for (sum=0, t=0; t <= map->num_texinfos; t++) {
+    i = counts[t];
+    counts[t] = sum;
+    sum += i; }
+
+  for (i=0; i < count; i++) {
+    t = map->faces[map->facescratch[i]].texinfo;
+    t = counts[(t >= 0 && t < map->num_texinfos) ? t : map->num_texinfos]++;
+    if (t < maxfaces) facelist[t] = map->facescratch[i]; }
+
+  return count < maxfaces ? count : maxfaces;
+}
+
+//=====================================================
+// Free data built by the query routines.
+//=====================================================
+static void bsp_free_visdata(bsp_t *map) {
+  free(map->nodeparents);
+  free(map->leafparents);
+  free(map->nodevisframes);
+  free(map->leafvisframes);
+  free(map->facevisframes);
+  free(map->facescratch);
+  free(map->texinfocounts);
+  free(map->pvsrow);
+  free(map->surfinfos);
+  free(map->materials);
+  free(map->texinfomaterials);
+  free(map->materialtable);
+  free(map->drawfaces);
+  free(map->drawbatches);
+  free(map->facepages);
+  free(map->facelmcoords);
+}
+
+//=====================================================
+//========= ROUTINES FOR THE NAVIGATION GRAPH ==========
+//=====================================================
+
+#define NAV_MIN_NORMAL 0.7f // steepest walkable slope
+#define NAV_STEPSIZE   18.0f
+#define NAV_EPSILON    1.0f
+#define NAV_BADCONTENTS (MASK_SOLID|CONTENTS_LAVA|CONTENTS_SLIME) // above floor
+
+//=====================================================
+// Vertex number of surfedge i of a face. Only for faces
+// that passed face_valid().
+//=====================================================
+static int face_vertex(bsp_t *map, int surfedge) {
+int e;
+
+  e = map->surfedges->dsurfedges[surfedge];
+  return e >= 0 ? map->edges[e].v[0] : map->edges[-e].v[1];
+}
+
+//=====================================================
+// Are face's surfedges, edges and vertices all in range?
+// Bad maps are skipped face by face rather than read
+// out of bounds.
+//=====================================================
+static int face_valid(bsp_t *map, face_t *face) {
+int numsurfedges, j, e;
+
+  if (!map->surfedges || !map->edges || !map->vertexs) return 0;
+
+  // num_surfedges is the lump size, only surfedges_t is loaded
+  numsurfedges = map->num_surfedges / (int)sizeof(int);
+  if (numsurfedges > (int)(sizeof(surfedges_t)/sizeof(int)))
+    numsurfedges = (int)(sizeof(surfedges_t)/sizeof(int));
+
+  if (face->firstedge < 0 || face->numedges < 0 || face->firstedge > numsurfedges - face->numedges)
+    return 0;
+
+  for (j=0; j < face->numedges; j++) {
+    e = map->surfedges->dsurfedges[face->firstedge+j];
+    if (e >= map->num_edges || e <= -map->num_edges) return 0;
+    if (face_vertex(map, face->firstedge+j) >= map->num_vertexs) return 0; }
+
+  return 1;
+}
+
+//=====================================================
+// Is face a floor bots can stand on?
+//=====================================================
+static int face_is_floor(bsp_t *map, face_t *face) {
+float nz;
+
+  if (face->texinfo >= 0 && face->texinfo < map->num_texinfos &&
+     (map->texinfos[face->texinfo].flags & (SURF_SKY|SURF_WARP|SURF_NODRAW)))
+    return 0;
+
+  if (face->planenum >= map->num_planes) return 0;
+  nz = map->planes[face->planenum].normal[2];
+  if (face->side) nz = -nz;
+
+  return nz >= NAV_MIN_NORMAL;
+}
+
+//=====================================================
+// Order link pairs for duplicate removal.
+//=====================================================
+static int compare_pairs(const void *a, const void *b) {
+const int *pa = (const int *)a, *pb = (const int *)b;
+
+  if (pa[0] != pb[0]) return pa[0] - pb[0];
+  return pa[1] - pb[1];
+}
+
+static navnode_t *sortnodes;
+
+static int compare_navmins(const void *a, const void *b) {
+float d;
+
+  d = sortnodes[*(const int *)a].mins[0] - sortnodes[*(const int *)b].mins[0];
+  return d < 0 ? -1 : d > 0;
+}
+
+//=====================================================
+// Add pair to grow-as-needed pair list.
+//=====================================================
+static void add_pair(int **pairs, int *numpairs, int *maxpairs, int a, int b) {
+int *p;
+
+  if (a == b) return;
+
+  if (*numpairs == *maxpairs) {
+    *maxpairs = *maxpairs ? *maxpairs*2 : 1024;
+    p = (int *)xmalloc(*maxpairs*2*sizeof(int));
+    if (*pairs) {
+      memcpy(p, *pairs, *numpairs*2*sizeof(int));
+      free(*pairs); }
+    *pairs = p; }
+
+  (*pairs)[*numpairs*2+0] = a < b ? a : b;
+  (*pairs)[*numpairs*2+1] = a < b ? b : a;
+  (*numpairs)++;
+}
+
+//=====================================================
+// Build walkable space graph: one node per floor face,
+// linked where faces share an edge or are a step apart.
+// Links are stored compressed (CSR) for fast walking.
+//=====================================================
+navgraph_t *nav_build(bsp_t *map) {
+navgraph_t *g;
+navnode_t *n;
+face_t *face;
+vertex_t *v;
+leaf_t *leaf;
+float p[3], dx, dy, dz;
+int *edgenodes, *order, *pairs, *deg;
+int numpairs, maxpairs;
+int i, j, k, e;
+
+  if (!map->faces || !map->planes || !map->edges || !map->surfedges || !map->vertexs)
+    return NULL;
+
+  g = (navgraph_t *)xmalloc(sizeof(navgraph_t));
+  memset(g, 0, sizeof(navgraph_t));
+
+  g->facenodes = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  g->nodes = (navnode_t *)xmalloc((map->num_faces+1)*sizeof(navnode_t));
+
+  // One node per floor face, centered on its vertices
+  for (i=0; i < map->num_faces; i++) {
+    face = &map->faces[i];
+    g->facenodes[i] = -1;
+    if (face->numedges < 3 || !face_valid(map, face) || !face_is_floor(map, face)) continue;
+
+    n = &g->nodes[g->numnodes];
+    n->face = i;
+    n->origin[0] = n->origin[1] = n->origin[2] = 0;
+    for (k=0; k < 3; k++) {
+      n->mins[k] = 99999;
+      n->maxs[k] = -99999; }
+
+    for (j=0; j < face->numedges; j++) {
+      v = &map->vertexs[face_vertex(map, face->firstedge+j)];
+      for (k=0; k < 3; k++) {
+        n->origin[k] += v->point[k];
+        if (v->point[k] < n->mins[k]) n->mins[k] = v->point[k];
+        if (v->point[k] > n->maxs[k]) n->maxs[k] = v->point[k]; } }
+
+    for (k=0; k < 3; k++) n->origin[k] /= face->numedges;
+
+    // Leaf just above the floor gives its area. Floors under
+    // solid, lava or slime can't be stood on, so no node.
+    n->area = -1;
+    if (map->nodes && map->leafs) {
+      p[0] = n->origin[0];
+      p[1] = n->origin[1];
+      p[2] = n->origin[2] + NAV_EPSILON;
+      leaf = &map->leafs[point_leaf(map, p)];
+      if (leaf->contents & NAV_BADCONTENTS) continue;
+      n->area = leaf->area; }
+
+    g->facenodes[i] = g->numnodes++; }
+
+  pairs = NULL;
+  numpairs = maxpairs = 0;
+
+  // Floors sharing an edge are connected
+  edgenodes = (int *)xmalloc((map->num_edges+1)*sizeof(int));
+  for (i=0; i < map->num_edges; i++) edgenodes[i] = -1;
+
+  for (i=0; i < g->numnodes; i++) {
+    face = &map->faces[g->nodes[i].face];
+    for (j=0; j < face->numedges; j++) {
+      e = map->surfedges->dsurfedges[face->firstedge+j];
+      if (e < 0) e = -e;
+      if (e >= map->num_edges) continue;
+      if (edgenodes[e] < 0)
+        edgenodes[e] = i;
+      else
+        add_pair(&pairs, &numpairs, &maxpairs, edgenodes[e], i); } }
+
+  free(edgenodes);
+
+  // Floors touching in x/y within a step height are connected.
+  // Sweep along x so only overlapping neighbours are compared.
+  order = (int *)xmalloc((g->numnodes+1)*sizeof(int));
+  for (i=0; i < g->numnodes; i++) order[i] = i;
+  sortnodes = g->nodes;
+  qsort(order, g->numnodes, sizeof(int), compare_navmins);
+
+  for (i=0; i < g->numnodes; i++) {
+    n = &g->nodes[order[i]];
+    for (j=i+1; j < g->numnodes; j++) {
+      if (g->nodes[order[j]].mins[0] > n->maxs[0] + NAV_EPSILON) break;
+      dy = g->nodes[order[j]].mins[1] - n->maxs[1];
+      if (n->mins[1] - g->nodes[order[j]].maxs[1] > dy)
+        dy = n->mins[1] - g->nodes[order[j]].maxs[1];
+      if (dy > NAV_EPSILON) continue;
+      dz = g->nodes[order[j]].mins[2] - n->maxs[2];
+      if (n->mins[2] - g->nodes[order[j]].maxs[2] > dz)
+        dz = n->mins[2] - g->nodes[order[j]].maxs[2];
+      if (dz > NAV_STEPSIZE) continue;
+      add_pair(&pairs, &numpairs, &maxpairs, order[i], order[j]); } }
+
+  free(order);
+
+  // Drop duplicates, then lay links out per node
+  if (numpairs) qsort(pairs, numpairs, 2*sizeof(int), compare_pairs);
+  for (i=j=0; i < numpairs; i++) {
+    if (j && pairs[i*2] == pairs[(j-1)*2] && pairs[i*2+1] == pairs[(j-1)*2+1])
+      continue;
+    pairs[j*2] = pairs[i*2];
+    pairs[j*2+1] = pairs[i*2+1];
+    j++; }
+  numpairs = j;
+
+  g->numlinks = numpairs*2;
+  g->firstlink = (int *)xmalloc((g->numnodes+1)*sizeof(int));
+  g->links = (int *)xmalloc((g->numlinks+1)*sizeof(int));
+  g->costs = (float *)xmalloc((g->numlinks+1)*sizeof(float));
+
+  deg = (int *)xmalloc((g->numnodes+1)*sizeof(int));
+  memset(deg, 0, (g->numnodes+1)*sizeof(int));
+  for (i=0; i < numpairs; i++) {
+    deg[pairs[i*2]]++;
+    deg[pairs[i*2+1]]++; }
+
+  for (k=0, i=0; i < g->numnodes; i++) {
+    g->firstlink[i] = k;
+    k += deg[i];
+    deg[i] = g->firstlink[i]; }
+  g->firstlink[g->numnodes] = k;
+
+  for (i=0; i < numpairs; i++) {
+    for (j=0; j < 2; j++) {
+      k = deg[pairs[i*2+j]]++;
+      g->links[k] = pairs[i*2+(j^1)];
+      dx = g->nodes[pairs[i*2]].origin[0] - g->nodes[pairs[i*2+1]].origin[0];
+      dy = g->nodes[pairs[i*2]].origin[1] - g->nodes[pairs[i*2+1]].origin[1];
+      dz = g->nodes[pairs[i*2]].origin[2] - g->nodes[pairs[i*2+1]].origin[2];
+      g->costs[k] = (float)sqrt(dx*dx + dy*dy + dz*dz); } }
+
+  free(deg);
+  free(pairs);
+
+  printf("navnode count=%d navlink count=%d\n", g->numnodes, g->numlinks);
+
+  return g;
+}
+
+//=====================================================
+// Release navigation graph.
+//=====================================================
+void nav_free(navgraph_t *g) {
+  if (!g) return;
+  free(g->nodes);
+  free(g->facenodes);
+  free(g->firstlink);
+  free(g->links);
+  free(g->costs);
+  free(g);
+}
+
+//=====================================================
+// Find floor node under point p: floor faces of p's
+// leaf first, else nearest node origin. -1 if none.
+//=====================================================
+int nav_point_node(bsp_t *map, navgraph_t *g, const float p[3]) {
+navnode_t *n;
+leaf_t *leaf;
+float d, best, dx, dy, dz;
+int i, f, found;
+
+  found = -1;
+  best = 1e30f;
+
+  if (map->nodes && map->leafs && map->leaffaces) {
+    leaf = &map->leafs[point_leaf(map, p)];
+    for (i=0; i < leaf->numleaffaces; i++) {
+      f = map->leaffaces->dleaffaces[leaf->firstleafface+i];
+      if (f >= map->num_faces || g->facenodes[f] < 0) continue;
+      n = &g->nodes[g->facenodes[f]];
+      if (p[0] < n->mins[0] - NAV_EPSILON || p[0] > n->maxs[0] + NAV_EPSILON ||
+          p[1] < n->mins[1] - NAV_EPSILON || p[1] > n->maxs[1] + NAV_EPSILON)
+        continue;
+      d = p[2] - n->maxs[2];
+      if (d < -NAV_STEPSIZE) continue;
+      if (d < best) {
+        best = d;
+        found = g->facenodes[f]; } } }
+
+  if (found >= 0) return found;
+
+  for (i=0; i < g->numnodes; i++) {
+    dx = p[0] - g->nodes[i].origin[0];
+    dy = p[1] - g->nodes[i].origin[1];
+    dz = p[2] - g->nodes[i].origin[2];
+    d = dx*dx + dy*dy + dz*dz;
+    if (d < best) {
+      best = d;
+      found = i; } }
+
+  return found;
+}
+
+//=====================================================
+// Allocate A* scratch for searching graph g. Each
+// thread searching the same graph needs its own.
+//=====================================================
+navsearch_t *nav_alloc_search(navgraph_t *g) {
+navsearch_t *s;
+
+  s = (navsearch_t *)xmalloc(sizeof(navsearch_t));
+  s->graph = g;
+  s->gscore = (float *)xmalloc((g->numnodes+1)*sizeof(float));
+  s->parent = (int *)xmalloc((g->numnodes+1)*sizeof(int));
+  s->stamps = (int *)xmalloc((g->numnodes+1)*sizeof(int));
+  s->heap = (navheap_t *)xmalloc((g->numlinks+2)*sizeof(navheap_t));
+  memset(s->stamps, 0, (g->numnodes+1)*sizeof(int));
+  s->stamp = 0;
+
+  return s;
+}
+
+void nav_free_search(navsearch_t *s) {
+  if (!s) return;
+  free(s->gscore);
+  free(s->parent);
+  free(s->stamps);
+  free(s->heap);
+  free(s);
+}
+
+//=====================================================
+// Straight line distance heuristic between nodes.
+//=====================================================
+static float nav_heuristic(navgraph_t *g, int a, int b) {
+float dx, dy, dz;
+
+  dx = g->nodes[a].origin[0] - g->nodes[b].origin[0];
+  dy = g->nodes[a].origin[1] - g->nodes[b].origin[1];
+  dz = g->nodes[a].origin[2] - g->nodes[b].origin[2];
+  return (float)sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+//=====================================================
+// A* from node start to node goal. Writes up to maxpath
+// nodes into path, returns full path length or -1.
+//=====================================================
+int nav_astar(navsearch_t *s, int start, int goal, int *path, int maxpath, float *cost) {
+navgraph_t *g = s->graph;
+navheap_t t;
+float gs;
+int numheap, node, next, i, j, c, len;
+
+  // Stamps avoid clearing per-node state between searches
+  s->stamp++;
+  if (s->stamp >= 0x3fffffff) {
+    memset(s->stamps, 0, (g->numnodes+1)*sizeof(int));
+    s->stamp = 1; }
+
+  s->gscore[start] = 0;
+  s->parent[start] = -1;
+  s->stamps[start] = s->stamp*2;
+  s->heap[0].f = nav_heuristic(g, start, goal);
+  s->heap[0].node = start;
+  numheap = 1;
+
+  while (numheap) {
+    node = s->heap[0].node;
+
+    // Pop min f off binary heap
+    s->heap[0] = s->heap[--numheap];
+    for (i=0; (c = i*2+1) < numheap; i = c) {
+      if (c+1 < numheap && s->heap[c+1].f < s->heap[c].f) c++;
+      if (s->heap[i].f <= s->heap[c].f) break;
+      t = s->heap[i]; s->heap[i] = s->heap[c]; s->heap[c] = t; }
+
+    // Stale entry for a node already expanded
+    if (s->stamps[node] == s->stamp*2+1) continue;
+    s->stamps[node] = s->stamp*2+1;
+
+    if (node == goal) break;
+
+    for (j = g->firstlink[node]; j < g->firstlink[node+1]; j++) {
+      next = g->links[j];
+      if (s->stamps[next] == s->stamp*2+1) continue;
+      gs = s->gscore[node] + g->costs[j];
+      if (s->stamps[next] == s->stamp*2 && gs >= s->gscore[next]) continue;
+
+      s->stamps[next] = s->stamp*2;
+      s->gscore[next] = gs;
+      s->parent[next] = node;
+
+      // Push, each link relaxes at most once so heap can't overflow
+      i = numheap++;
+      s->heap[i].f = gs + nav_heuristic(g, next, goal);
+      s->heap[i].node = next;
+      while (i && s->heap[(i-1)/2].f > s->heap[i].f) {
+        t = s->heap[i]; s->heap[i] = s->heap[(i-1)/2]; s->heap[(i-1)/2] = t;
+        i = (i-1)/2; } } }
+
+  if (s->stamps[goal] != s->stamp*2+1) return -1;
+
+  if (cost) *cost = s->gscore[goal];
+
+  // Walk parents back, then store start to goal
+  for (len=0, node=goal; node >= 0; node = s->parent[node]) len++;
+  for (i=len-1, node=goal; node >= 0; node = s->parent[node], i--)
+    if (i < maxpath) path[i] = node;
+
+  return len;
+}
+
+//=====================================================
+// Run a batch of path queries with one searcher.
+// Returns number of queries that found a path.
+//=====================================================
+int nav_find_paths(bsp_t *map, navsearch_t *s, navquery_t *queries, int numqueries) {
+navquery_t *q;
+int i, start, goal, found;
+
+  found = 0;
+
+  for (i=0; i < numqueries; i++) {
+    q = &queries[i];
+    q->numpath = -1;
+    q->cost = 0;
+
+    start = nav_point_node(map, s->graph, q->start);
+    goal = nav_point_node(map, s->graph, q->goal);
+    if (start < 0 || goal < 0) continue;
+
+    q->numpath = nav_astar(s, start, goal, q->path, q->maxpath, &q->cost);
+    if (q->numpath >= 0) found++; }
+
+  return found;
+}
+
+typedef struct {
+  bsp_t       *map;
+  navsearch_t *search;
+  navquery_t  *queries;
+  int          numqueries;
+  int          found;
+} navjob_t;
+
+static void nav_job(void *arg) {
+navjob_t *job = (navjob_t *)arg;
+
+  job->found = nav_find_paths(job->map, job->search, job->queries, job->numqueries);
+}
+
+//=====================================================
+// Run a batch of path queries on numthreads threads
+// (0 = one per CPU), each with its own searcher and a
+// contiguous slice of queries. Graph is shared read
+// only. Returns number of queries that found a path.
+//=====================================================
+int nav_find_paths_threaded(bsp_t *map, navgraph_t *g, navquery_t *queries,
+  int numqueries, int numthreads) {
+navjob_t jobs[BSP_MAXTHREADS];
+int i, first, found;
+
+  if (numthreads <= 0) numthreads = bsp_numthreads();
+  if (numthreads > BSP_MAXTHREADS) numthreads = BSP_MAXTHREADS;
+  if (numthreads > numqueries) numthreads = numqueries;
+  if (numthreads <= 0) return 0;
+
+  for (first=0, i=0; i < numthreads; i++) {
+    jobs[i].map = map;
+    jobs[i].search = nav_alloc_search(g);
+    jobs[i].queries = queries + first;
+    jobs[i].numqueries = (numqueries - first) / (numthreads - i);
+    jobs[i].found = 0;
+    first += jobs[i].numqueries; }
+
+  bsp_run_threads(nav_job, jobs, sizeof(navjob_t), numthreads);
+
+  for (found=0, i=0; i < numthreads; i++) {
+    found += jobs[i].found;
+    nav_free_search(jobs[i].search); }
+
+  return found;
+}
+
+//=====================================================
+//========= LIGHTMAP SAMPLING FOR POINTS ==============
+//=====================================================
+
+//=====================================================
+// Work out lightmap extents of every face from its
+// vertices projected through texinfo (16 units/sample).
+//=====================================================
+void bsp_build_surfinfos(bsp_t *map) {
+surfinfo_t *si;
+face_t *face;
+texinfo_t *tex;
+vertex_t *v;
+float mins[2], maxs[2], val;
+int i, j, k, bmin, bmax, lightsize;
+
+  if (map->surfinfos || !map->faces || !map->texinfos) return;
+
+  // Only the first sizeof(lightdata_t) bytes of the lump are loaded
+  lightsize = map->num_lightdatas;
+  if (lightsize > (int)sizeof(lightdata_t)) lightsize = (int)sizeof(lightdata_t);
+
+  map->surfinfos = (surfinfo_t *)xmalloc((map->num_faces+1)*sizeof(surfinfo_t));
+  memset(map->surfinfos, 0, (map->num_faces+1)*sizeof(surfinfo_t));
+
+  for (i=0; i < map->num_faces; i++) {
+    face = &map->faces[i];
+    si = &map->surfinfos[i];
+    if (face->texinfo < 0 || face->texinfo >= map->num_texinfos) continue;
+    if (!face_valid(map, face)) continue;
+    tex = &map->texinfos[face->texinfo];
+
+    mins[0] = mins[1] = 999999;
+    maxs[0] = maxs[1] = -99999;
+
+    for (j=0; j < face->numedges; j++) {
+      v = &map->vertexs[face_vertex(map, face->firstedge+j)];
+      for (k=0; k < 2; k++) {
+        val = DOTPRODUCT(v->point, tex->vecs[k]) + tex->vecs[k][3];
+        if (val < mins[k]) mins[k] = val;
+        if (val > maxs[k]) maxs[k] = val; } }
+
+    for (k=0; k < 2; k++) {
+      bmin = (int)floor(mins[k]/16);
+      bmax = (int)ceil(maxs[k]/16);
+      si->texturemins[k] = bmin*16;
+      si->extents[k] = (bmax - bmin)*16; }
+
+    // Lit if it has samples for every style in the loaded lump.
+    // Extents are shorts, wrapped negative on huge faces.
+    for (k=0; k < 4 && face->styles[k] != 255; k++);
+    si->numstyles = k;
+    si->lit = face->lightofs >= 0 && k > 0 && map->lightdatas && !(tex->flags & (SURF_SKY|SURF_WARP)) &&
+      si->extents[0] >= 0 && si->extents[1] >= 0 &&
+      face->lightofs <= lightsize - 3*((si->extents[0]>>4)+1)*((si->extents[1]>>4)+1)*k; }
+}
+
+//=====================================================
+// Bilinear sample of face lightmap at s,t summed over
+// its styles (weights in styles[], NULL = all 1).
+//=====================================================
+static void sample_lightmap(bsp_t *map, int f, float s, float t,
+  const float *styles, float color[3]) {
+surfinfo_t *si = &map->surfinfos[f];
+unsigned char *lm, *p;
+float ds, dt, fs, ft, w[4], scale;
+int smax, tmax, s0, t0, s1, t1, i, n;
+
+  smax = (si->extents[0]>>4)+1;
+  tmax = (si->extents[1]>>4)+1;
+
+  // Sample n covers s = texturemins + n*16
+  ds = (s - si->texturemins[0]) / 16;
+  dt = (t - si->texturemins[1]) / 16;
+  s0 = (int)ds; fs = ds - s0;
+  t0 = (int)dt; ft = dt - t0;
+  if (s0 >= smax-1) { s0 = smax-1; fs = 0; }
+  if (t0 >= tmax-1) { t0 = tmax-1; ft = 0; }
+  s1 = s0 + (fs > 0);
+  t1 = t0 + (ft > 0);
+
+  w[0] = (1-fs)*(1-ft);
+  w[1] = fs*(1-ft);
+  w[2] = (1-fs)*ft;
+  w[3] = fs*ft;
+
+  color[0] = color[1] = color[2] = 0;
+  lm = map->lightdatas->dlightdata + map->faces[f].lightofs;
+
+  for (n=0; n < si->numstyles; n++, lm += 3*smax*tmax) {
+    scale = (styles ? styles[map->faces[f].styles[n]] : 1.0f) / 255;
+    for (i=0; i < 3; i++) {
+      p = lm + i;
+      color[i] += scale * (w[0]*p[3*(t0*smax+s0)] + w[1]*p[3*(t0*smax+s1)] +
+                           w[2]*p[3*(t1*smax+s0)] + w[3]*p[3*(t1*smax+s1)]); } }
+}
+
+//=====================================================
+// Find first face hit going from start to end and
+// sample its light. -1 = nothing hit, 0 = hit unlit
+// surface, 1 = color set.
+//=====================================================
+static int lightpoint_r(bsp_t *map, int num, const float start[3], const float end[3],
+  const float *styles, float color[3]) {
+node_t *node;
+plane_t *plane;
+texinfo_t *tex;
+surfinfo_t *si;
+float front, back, frac, mid[3], s, t;
+int side, r, i, f;
+
+  if (num < 0) return -1;
+
+  node = &map->nodes[num];
+  plane = &map->planes[node->planenum];
+  front = DOTPRODUCT(start, plane->normal) - plane->dist;
+  back = DOTPRODUCT(end, plane->normal) - plane->dist;
+  side = front < 0;
+
+  if ((back < 0) == side)
+    return lightpoint_r(map, node->child[side], start, end, styles, color);
+
+  frac = front / (front - back);
+  for (i=0; i < 3; i++) mid[i] = start[i] + (end[i] - start[i])*frac;
+
+  // Near side first
+  r = lightpoint_r(map, node->child[side], start, mid, styles, color);
+  if (r >= 0) return r;
+
+  // Then faces lying on this node's plane
+  for (i=0; i < node->numfaces; i++) {
+    f = node->firstface + i;
+    if (f >= map->num_faces) break;
+    si = &map->surfinfos[f];
+    if (map->faces[f].texinfo < 0 || map->faces[f].texinfo >= map->num_texinfos) continue;
+    tex = &map->texinfos[map->faces[f].texinfo];
+    if (tex->flags & (SURF_SKY|SURF_WARP)) continue;
+
+    s = DOTPRODUCT(mid, tex->vecs[0]) + tex->vecs[0][3];
+    t = DOTPRODUCT(mid, tex->vecs[1]) + tex->vecs[1][3];
+    if (s < si->texturemins[0] || t < si->texturemins[1]) continue;
+    if (s - si->texturemins[0] > si->extents[0] || t - si->texturemins[1] > si->extents[1])
+      continue;
+
+    if (!si->lit) return 0;
+    sample_lightmap(map, f, s, t, styles, color);
+    return 1; }
+
+  return lightpoint_r(map, node->child[!side], mid, end, styles, color);
+}
+
+//=====================================================
+// Light many points at once from the lightmap of the
+// surface below each. Colors are 0..1 per style (can
+// exceed 1 with overbright or several styles), black
+// where nothing lit is found. Returns number lit.
+//=====================================================
+int bsp_light_points(bsp_t *map, const float (*points)[3], int numpoints,
+  const float *styles, float (*colors)[3]) {
+float end[3];
+int i, lit, headnode;
+
+  bsp_build_surfinfos(map);
+  if (!map->nodes || !map->surfinfos) return 0;
+
+  headnode = map->models ? map->models[0].headnode : 0;
+  lit = 0;
+
+  for (i=0; i < numpoints; i++) {
+    end[0] = points[i][0];
+    end[1] = points[i][1];
+    end[2] = points[i][2] - 2048;
+    if (lightpoint_r(map, headnode, points[i], end, styles, colors[i]) > 0)
+      lit++;
+    else
+      colors[i][0] = colors[i][1] = colors[i][2] = 0; }
+
+  return lit;
+}
+
+//=====================================================
+// Precompute light at the corners of cellsize cubes
+// covering the world model for bsp_lightgrid_sample().
+// Corners inside solid are flagged rather than lit, as
+// their trace down would reach the room below.
+//=====================================================
+lightgrid_t *bsp_build_lightgrid(bsp_t *map, float cellsize, const float *styles) {
+lightgrid_t *g;
+float (*points)[3];
+int x, y, z, n, o;
+
+  if (!map->models || cellsize <= 0) return NULL;
+
+  g = (lightgrid_t *)xmalloc(sizeof(lightgrid_t));
+  g->cellsize = cellsize;
+  for (n=0; n < 3; n++) {
+    g->origin[n] = map->models[0].mins[n];
+    g->size[n] = (int)ceil((map->models[0].maxs[n] - map->models[0].mins[n]) / cellsize) + 1; }
+
+  g->colors = (float (*)[3])xmalloc(g->size[0]*g->size[1]*g->size[2]*sizeof(*g->colors));
+  g->solid = (unsigned char *)xmalloc(g->size[0]*g->size[1]*g->size[2]);
+  points = (float (*)[3])xmalloc(g->size[0]*sizeof(*points));
+
+  // Light one row of x at a time
+  for (z=0; z < g->size[2]; z++) {
+    for (y=0; y < g->size[1]; y++) {
+      for (x=0; x < g->size[0]; x++) {
+        points[x][0] = g->origin[0] + x*cellsize;
+        points[x][1] = g->origin[1] + y*cellsize;
+        points[x][2] = g->origin[2] + z*cellsize; }
+      o = (z*g->size[1] + y)*g->size[0];
+      bsp_light_points(map, (const float (*)[3])points, g->size[0], styles, g->colors + o);
+
+      for (x=0; x < g->size[0]; x++) {
+        g->solid[o+x] = map->leafs && (map->leafs[point_leaf(map, points[x])].contents & MASK_SOLID) != 0;
+        if (g->solid[o+x]) g->colors[o+x][0] = g->colors[o+x][1] = g->colors[o+x][2] = 0; } } }
+
+  free(points);
+
+  printf("lightgrid %dx%dx%d\n", g->size[0], g->size[1], g->size[2]);
+
+  return g;
+}
+
+//=====================================================
+// Trilinear lookup of light at p in grid. Solid corners
+// are left out and the rest reweighted, black if all 8
+// are solid.
+//=====================================================
+void bsp_lightgrid_sample(lightgrid_t *g, const float p[3], float color[3]) {
+float f[3], *c;
+int i[3], k, n, o;
+float w, total;
+
+  for (k=0; k < 3; k++) {
+    f[k] = (p[k] - g->origin[k]) / g->cellsize;
+    if (f[k] < 0) f[k] = 0;
+    if (f[k] > g->size[k]-1) f[k] = (float)(g->size[k]-1);
+    i[k] = (int)f[k];
+    if (i[k] >= g->size[k]-1) i[k] = g->size[k] > 1 ? g->size[k]-2 : 0;
+    f[k] -= i[k]; }
+
+  color[0] = color[1] = color[2] = 0;
+  total = 0;
+
+  // Blend the 8 corners around p
+  for (n=0; n < 8; n++) {
+    w = (n&1 ? f[0] : 1-f[0]) * (n&2 ? f[1] : 1-f[1]) * (n&4 ? f[2] : 1-f[2]);
+    if (w <= 0) continue;
+    o = ((i[2] + ((n>>2)&1))*g->size[1] + i[1] + ((n>>1)&1))*g->size[0] + i[0] + (n&1);
+    if (g->solid[o]) continue;
+    c = g->colors[o];
+    total += w;
+    for (k=0; k < 3; k++) color[k] += w*c[k]; }
+
+  if (total > 0 && total < 1)
+    for (k=0; k < 3; k++) color[k] /= total;
+}
+
+void bsp_free_lightgrid(lightgrid_t *g) {
+  if (!g) return;
+  free(g->colors);
+  free(g->solid);
+  free(g);
+}
+
+//=====================================================
+//========= MATERIALS AND DRAW BATCHES ================
+//=====================================================
+
+#define SURF_DRAWFLAGS (SURF_SKY|SURF_WARP|SURF_TRANS33|SURF_TRANS66|SURF_FLOWING|SURF_NODRAW)
+
+#define LIGHTMAP_PAGE 128 // lightmap page width/height in samples
+
+//=====================================================
+// Hash of texture name, stops at 32 chars or nul.
+//=====================================================
+static unsigned int hash_name(const char *name) {
+unsigned int h;
+int i;
+
+  for (h = 2166136261u, i=0; i < 32 && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+//=====================================================
+// Intern texinfo texture names: one material per name
+// and draw flags, with animation chains resolved.
+//=====================================================
+void bsp_build_materials(bsp_t *map) {
+material_t *m;
+texinfo_t *tex;
+int *table;
+int size, i, j, n, slot, flags;
+
+  if (map->materials || !map->texinfos) return;
+
+  map->materials = (material_t *)xmalloc((map->num_texinfos+1)*sizeof(material_t));
+  map->texinfomaterials = (int *)xmalloc((map->num_texinfos+1)*sizeof(int));
+  map->nummaterials = 0;
+
+  // Open addressed table of material numbers, at most half full.
+  // Kept for bsp_find_material().
+  for (size = 64; size < map->num_texinfos*2; size <<= 1);
+  table = (int *)xmalloc(size*sizeof(int));
+  for (i=0; i < size; i++) table[i] = -1;
+  map->materialtable = table;
+  map->materialtablesize = size;
+
+  for (i=0; i < map->num_texinfos; i++) {
+    tex = &map->texinfos[i];
+    flags = tex->flags & SURF_DRAWFLAGS;
+
+    for (slot = hash_name(tex->texture) & (size-1); table[slot] >= 0; slot = (slot+1) & (size-1)) {
+      m = &map->materials[table[slot]];
+      if (m->flags == flags && !strncmp(m->name, tex->texture, 32)) break; }
+
+    if (table[slot] < 0) {
+      m = &map->materials[map->nummaterials];
+      memcpy(m->name, tex->texture, 32);
+      m->name[31] = 0;
+      m->flags = flags;
+      m->animnext = -1;
+      m->numframes = 1;
+      table[slot] = map->nummaterials++; }
+
+    map->texinfomaterials[i] = table[slot]; }
+
+  // Follow nexttexinfo chains, bounded in case of bad links
+  for (i=0; i < map->num_texinfos; i++) {
+    m = &map->materials[map->texinfomaterials[i]];
+    j = map->texinfos[i].nexttexinfo;
+    if (j < 0 || j >= map->num_texinfos || m->animnext >= 0) continue;
+
+    m->animnext = map->texinfomaterials[j];
+    for (n=1; j >= 0 && j < map->num_texinfos && j != i && n <= map->num_texinfos; n++)
+      j = map->texinfos[j].nexttexinfo;
+    m->numframes = n; }
+
+  printf("material count=%d\n", map->nummaterials);
+}
+
+//=====================================================
+// Find material number of texture name with SURF_*
+// flags (only SURF_DRAWFLAGS matter), -1 if unused.
+// A texture used with several flag sets has a material
+// for each.
+//=====================================================
+int bsp_find_material(bsp_t *map, const char *name, int flags) {
+material_t *m;
+int slot, mask;
+
+  bsp_build_materials(map);
+  if (!map->materialtable) return -1;
+
+  flags &= SURF_DRAWFLAGS;
+  mask = map->materialtablesize-1;
+
+  for (slot = hash_name(name) & mask; map->materialtable[slot] >= 0; slot = (slot+1) & mask) {
+    m = &map->materials[map->materialtable[slot]];
+    if (m->flags == flags && !strncmp(m->name, name, 32)) return map->materialtable[slot]; }
+
+  return -1;
+}
+
+//=====================================================
+// Draw order of a material: opaque, sky, warp, trans.
+//=====================================================
+static int material_class(material_t *m) {
+  if (m->flags & (SURF_TRANS33|SURF_TRANS66)) return 3;
+  if (m->flags & SURF_WARP) return 2;
+  if (m->flags & SURF_SKY) return 1;
+  return 0;
+}
+
+//=====================================================
+// Place a smax x tmax lightmap in the current page,
+// starting a new page when it is full. Skyline packing
+// as in the engine's LM_AllocBlock.
+//=====================================================
+static int alloc_lightmap(int *allocated, int *page, int smax, int tmax, short pos[2]) {
+int i, j, best, best2, tries;
+
+  for (tries=0; tries < 2; tries++) {
+    best = LIGHTMAP_PAGE;
+
+    for (i=0; i <= LIGHTMAP_PAGE - smax; i++) {
+      best2 = 0;
+      for (j=0; j < smax; j++) {
+        if (allocated[i+j] >= best) break;
+        if (allocated[i+j] > best2) best2 = allocated[i+j]; }
+      if (j == smax) {
+        pos[0] = i;
+        pos[1] = best = best2; } }
+
+    if (best + tmax <= LIGHTMAP_PAGE) {
+      for (i=0; i < smax; i++) allocated[pos[0]+i] = best + tmax;
+      return *page; }
+
+    // Full, start next page
+    memset(allocated, 0, LIGHTMAP_PAGE*sizeof(int));
+    (*page)++; }
+
+  return -1;
+}
+
+//=====================================================
+// Order faces by draw class, material and unlit first,
+// pack their lightmaps into pages in that order, and
+// cut the list into batches of one material and page.
+//=====================================================
+void bsp_build_drawbatches(bsp_t *map) {
+int allocated[LIGHTMAP_PAGE];
+drawbatch_t *b;
+surfinfo_t *si;
+int *counts, *keys;
+int numkeys, page, i, k, f, t, sum;
+
+  if (map->drawbatches || !map->faces) return;
+
+  bsp_build_materials(map);
+  bsp_build_surfinfos(map);
+  if (!map->materials || !map->surfinfos) return;
+
+  // Counting sort of faces on class*nummaterials + material, then
+  // unlit before lit so each material is one unlit run then pages
+  numkeys = 8*map->nummaterials + 1;
+  counts = (int *)xmalloc((numkeys+1)*sizeof(int));
+  keys = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  memset(counts, 0, (numkeys+1)*sizeof(int));
+
+  for (i=0; i < map->num_faces; i++) {
+    t = map->faces[i].texinfo;
+    keys[i] = numkeys-1; // skipped: bad texinfo or nodraw
+    if (t >= 0 && t < map->num_texinfos && !(map->texinfos[t].flags & SURF_NODRAW)) {
+      k = map->texinfomaterials[t];
+      keys[i] = (material_class(&map->materials[k])*map->nummaterials + k)*2 + map->surfinfos[i].lit; }
+    counts[keys[i]]++; }
+
+  for (sum=0, k=0; k < numkeys; k++) {
+    i = counts[k];
+    counts[k] = sum;
+    sum += i; }
+
+  map->drawfaces = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  for (i=0; i < map->num_faces; i++)
+    map->drawfaces[counts[keys[i]]++] = i;
+
+  // Skipped faces sort last, after the end of the previous key
+  map->numdrawfaces = numkeys > 1 ? counts[numkeys-2] : 0;
+
+  // Lightmaps packed in draw order keep pages ascending per material
+  map->facepages = (int *)xmalloc((map->num_faces+1)*sizeof(int));
+  map->facelmcoords = (short (*)[2])xmalloc((map->num_faces+1)*sizeof(short[2]));
+  memset(allocated, 0, sizeof(allocated));
+  page = 0;
+
+  for (i=0; i < map->num_faces; i++) {
+    f = map->drawfaces[i];
+    si = &map->surfinfos[f];
+    map->facepages[f] = -1;
+    map->facelmcoords[f][0] = map->facelmcoords[f][1] = 0;
+    if (i >= map->numdrawfaces || !si->lit) continue;
+    map->facepages[f] = alloc_lightmap(allocated, &page,
+      (si->extents[0]>>4)+1, (si->extents[1]>>4)+1, map->facelmcoords[f]); }
+
+  map->numlightpages = page+1;
+
+  // One batch per run of material and page
+  map->drawbatches = (drawbatch_t *)xmalloc((map->numdrawfaces+1)*sizeof(drawbatch_t));
+  map->numdrawbatches = 0;
+  b = NULL;
+
+  for (i=0; i < map->numdrawfaces; i++) {
+    f = map->drawfaces[i];
+    k = map->texinfomaterials[map->faces[f].texinfo];
+    if (!b || b->material != k || b->lightpage != map->facepages[f]) {
+      b = &map->drawbatches[map->numdrawbatches++];
+      b->material = k;
+      b->lightpage = map->facepages[f];
+      b->firstface = i;
+      b->numfaces = 0; }
+    b->numfaces++; }
+
+  free(keys);
+  free(counts);
+
+  printf("drawbatch count=%d lightpage count=%d\n", map->numdrawbatches, map->numlightpages);
+}
+
+//=====================================================
+//======== QUERY RECORDING AND REPLAY ================
+//=====================================================
+
+#define QT_POINTLEAF 0 // args: point
+#define QT_TRACE     1 // args: start, end
+#define QT_BOXLEAFS  2 // args: mins, maxs
+#define QT_INPVS     3 // args: p1, p2
+#define QT_NUMTYPES  4
+
+static const char *qt_names[QT_NUMTYPES] = { "pointleaf", "trace", "boxleafs", "inpvs" };
+static const int   qt_numargs[QT_NUMTYPES] = { 3, 6, 6, 6 };
+
+// One recorded query. On disk: type byte, time, args, result.
+typedef struct {
+  unsigned char      type;
+  unsigned long long time;   // microseconds since recording started
+  float              args[6];
+  int                result; // leaf, hit fraction bits, leaf count, 0/1
+} qtrace_t;
+
+FILE  *qtrace_file;  // recording if not NULL
+bsp_t *qtrace_map;   // only queries on this map are recorded
+double qtrace_start;
+
+#define QTRACING(map) (qtrace_file && (map) == qtrace_map)
+
+//=================================================
+// Start recording queries against map to filepath.
+// Header is magic and the map's CRC32C, so a trace
+// only replays against the map it was taken on.
+//=================================================
+int qtrace_open(bsp_t *map, char *filepath) {
+  qtrace_file = fopen(filepath, "wb");
+  if (!qtrace_file) {
+    fprintf(stderr, "qtrace_open: %s: %s\n", filepath, strerror(errno));
+    return 0; }
+
+  fwrite("QTR3", 1, 4, qtrace_file);
+  fwrite(&map->crc32c, sizeof(map->crc32c), 1, qtrace_file);
+  qtrace_map = map;
+  qtrace_start = bsp_seconds();
+  return 1;
+}
+
+void qtrace_close(void) {
+  if (qtrace_file) fclose(qtrace_file);
+  qtrace_file = NULL;
+  qtrace_map = NULL;
+}
+
+//=================================================
+// Append one query to the trace file. The record is
+// built first and written with one fwrite, which
+// stdio locks, so queries from several threads don't
+// interleave.
+//=================================================
+static void qtrace_record(int type, double time, const float *a, const float *b, int result) {
+unsigned char rec[1+sizeof(unsigned long long)+6*sizeof(float)+sizeof(int)];
+unsigned long long us;
+int n;
+
+  us = (unsigned long long)((time - qtrace_start)*1e6);
+
+  rec[0] = (unsigned char)type;
+  n = 1;
+  memcpy(rec+n, &us, sizeof(us)); n += sizeof(us);
+  memcpy(rec+n, a, 3*sizeof(float)); n += 3*sizeof(float);
+  if (b) { memcpy(rec+n, b, 3*sizeof(float)); n += 3*sizeof(float); }
+  memcpy(rec+n, &result, sizeof(result)); n += sizeof(result);
+
+  fwrite(rec, 1, n, qtrace_file);
+}
+
+//=================================================
+// Read next query from trace file, 0 at end.
+//=================================================
+static int qtrace_read(FILE *f, qtrace_t *q) {
+  if (fread(&q->type, 1, 1, f) != 1 || q->type >= QT_NUMTYPES) return 0;
+  if (fread(&q->time, sizeof(q->time), 1, f) != 1) return 0;
+  if (fread(q->args, sizeof(float), qt_numargs[q->type], f) != (size_t)qt_numargs[q->type]) return 0;
+  return fread(&q->result, sizeof(q->result), 1, f) == 1;
+}
+
+//=====================================================
+// Public point query: leaf containing point p.
+//=====================================================
+int bsp_point_leaf(bsp_t *map, const float p[3]) {
+double time;
+int leaf;
+
+  if (!QTRACING(map)) return point_leaf(map, p);
+
+  time = bsp_seconds();
+  leaf = point_leaf(map, p);
+  qtrace_record(QT_POINTLEAF, time, p, NULL, leaf);
+  return leaf;
+}
+
+//=====================================================
+// Walk segment p1-p2 through tree, front side first.
+// Returns 1 with *fraction set at first solid leaf.
+//=====================================================
+static int trace_r(bsp_t *map, int num, float p1f, float p2f,
+  const float p1[3], const float p2[3], float *fraction) {
+plane_t *plane;
+float t1, t2, frac, midf, mid[3];
+int side, i;
+
+  if (num < 0) {
+    if (!(map->leafs[-1-num].contents & MASK_SOLID)) return 0;
+    *fraction = p1f;
+    return 1; }
+
+  plane = &map->planes[map->nodes[num].planenum];
+  if (plane->type < 3) {
+    t1 = p1[plane->type] - plane->dist;
+    t2 = p2[plane->type] - plane->dist; }
+  else {
+    t1 = DOTPRODUCT(p1, plane->normal) - plane->dist;
+    t2 = DOTPRODUCT(p2, plane->normal) - plane->dist; }
+
+  if (t1 >= 0 && t2 >= 0)
+    return trace_r(map, map->nodes[num].child[0], p1f, p2f, p1, p2, fraction);
+  if (t1 < 0 && t2 < 0)
+    return trace_r(map, map->nodes[num].child[1], p1f, p2f, p1, p2, fraction);
+
+  // Split at plane, near side first
+  side = t1 < 0;
+  frac = t1 / (t1 - t2);
+  for (i=0; i < 3; i++) mid[i] = p1[i] + frac*(p2[i] - p1[i]);
+  midf = p1f + frac*(p2f - p1f);
+
+  if (trace_r(map, map->nodes[num].child[side], p1f, midf, p1, mid, fraction))
+    return 1;
+  return trace_r(map, map->nodes[num].child[side^1], midf, p2f, mid, p2, fraction);
+}
+
+//=====================================================
+// Trace line start-end against solid leafs. Returns
+// fraction of the way to end where it hits (1 = clear).
+//=====================================================
+float bsp_trace_line(bsp_t *map, const float start[3], const float end[3]) {
+double time;
+float fraction;
+
+  time = QTRACING(map) ? bsp_seconds() : 0;
+
+  fraction = 1;
+  if (map->nodes && map->leafs)
+    trace_r(map, map->models ? map->models[0].headnode : 0, 0, 1, start, end, &fraction);
+
+  if (QTRACING(map)) {
+    int bits;
+    memcpy(&bits, &fraction, sizeof(bits));
+    qtrace_record(QT_TRACE, time, start, end, bits); }
+
+  return fraction;
+}
+
+//=====================================================
+// Collect leafs touching box into list.
+//=====================================================
+static int boxleafs_r(bsp_t *map, int num, const float mins[3], const float maxs[3],
+  int *list, int maxleafs, int count) {
+plane_t *plane;
+float dmin, dmax;
+int i;
+
+  while (num >= 0) {
+    plane = &map->planes[map->nodes[num].planenum];
+
+    // Box corners nearest and farthest along plane normal
+    for (dmin=dmax=-plane->dist, i=0; i < 3; i++) {
+      dmin += plane->normal[i] * (plane->normal[i] >= 0 ? mins[i] : maxs[i]);
+      dmax += plane->normal[i] * (plane->normal[i] >= 0 ? maxs[i] : mins[i]); }
+
+    if (dmin >= 0)
+      num = map->nodes[num].child[0];
+    else if (dmax < 0)
+      num = map->nodes[num].child[1];
+    else {
+      count = boxleafs_r(map, map->nodes[num].child[0], mins, maxs, list, maxleafs, count);
+      num = map->nodes[num].child[1]; } }
+
+  if (count < maxleafs) list[count] = -1 - num;
+  return count + 1;
+}
+
+//=====================================================
+// Find leafs touching box. Writes up to maxleafs into
+// list and returns total number touched.
+//=====================================================
+int bsp_box_leafs(bsp_t *map, const float mins[3], const float maxs[3], int *list, int maxleafs) {
+double time;
+int count;
+
+  time = QTRACING(map) ? bsp_seconds() : 0;
+
+  count = 0;
+  if (map->nodes)
+    count = boxleafs_r(map, map->models ? map->models[0].headnode : 0,
+      mins, maxs, list, maxleafs, 0);
+
+  if (QTRACING(map)) qtrace_record(QT_BOXLEAFS, time, mins, maxs, count);
+
+  return count;
+}
+
+//=====================================================
+// Is p2 in the PVS of p1? Area portals not considered.
+// Shares no scratch state, safe to call from threads.
+//=====================================================
+int bsp_in_pvs(bsp_t *map, const float p1[3], const float p2[3]) {
+double time;
+int c1, c2, visible;
+
+  time = QTRACING(map) ? bsp_seconds() : 0;
+
+  visible = 1;
+  if (map->nodes && map->leafs) {
+    c1 = map->leafs[point_leaf(map, p1)].cluster;
+    c2 = map->leafs[point_leaf(map, p2)].cluster;
+    if (c1 < 0 || c2 < 0)
+      visible = 0;
+    else if (c2 < bsp_numclusters(map) && map->pvsmatrix && c1 < bsp_numclusters(map))
+      visible = (map->pvsmatrix[c1*map->rowstride + (c2>>3)] >> (c2&7)) & 1;
+    else if (c2 < bsp_numclusters(map))
+      visible = vis_test(map, c1, 0, c2); }
+
+  if (QTRACING(map)) qtrace_record(QT_INPVS, time, p1, p2, visible);
+
+  return visible;
+}
+
+#define QT_BUCKETS 24 // latency buckets, bucket n < 2^n ns
+
+typedef struct {
+  bsp_t        *map;
+  qtrace_t     *queries;
+  int           numqueries;
+  unsigned long hist[QT_NUMTYPES][QT_BUCKETS];
+  unsigned long count[QT_NUMTYPES], mismatch[QT_NUMTYPES];
+  double        total[QT_NUMTYPES];
+} replayjob_t;
+
+//=====================================================
+// Run one slice of a trace into the job's histograms.
+//=====================================================
+static void replay_job(void *arg) {
+replayjob_t *job = (replayjob_t *)arg;
+int leafs[1024];
+qtrace_t *q;
+double start, ns;
+float fraction;
+int result, i, b;
+
+  for (i=0; i < job->numqueries; i++) {
+    q = &job->queries[i];
+    start = bsp_seconds();
+    switch (q->type) {
+      case QT_POINTLEAF:
+        result = bsp_point_leaf(job->map, q->args);
+        break;
+      case QT_TRACE:
+        fraction = bsp_trace_line(job->map, q->args, q->args+3);
+        memcpy(&result, &fraction, sizeof(result));
+        break;
+      case QT_BOXLEAFS:
+        result = bsp_box_leafs(job->map, q->args, q->args+3, leafs, 1024);
+        break;
+      default:
+        result = bsp_in_pvs(job->map, q->args, q->args+3);
+        break; }
+    ns = (bsp_seconds() - start)*1e9;
+
+    for (b=0; b < QT_BUCKETS-1 && ns >= (double)(1UL<<b); b++);
+    job->hist[q->type][b]++;
+    job->count[q->type]++;
+    job->total[q->type] += ns;
+    if (result != q->result) job->mismatch[q->type]++; }
+}
+
+//=====================================================
+// Re-run every query in tracefile against map as fast
+// as possible on numthreads threads (0 = one per CPU),
+// each replaying a contiguous slice, and print merged
+// per type latency histograms. Results differing from
+// the recording are counted. Traces of other maps are
+// rejected.
+//=====================================================
+void qtrace_replay(bsp_t *map, char *tracefile, int numthreads) {
+replayjob_t *jobs;
+qtrace_t *queries;
+unsigned long n;
+unsigned int crc;
+char magic[4];
+double start;
+FILE *f;
+FILE *recording;
+long size;
+int numqueries, first, i, t, b;
+
+  f = fopen(tracefile, "rb");
+  if (!f || fread(magic, 1, 4, f) != 4 || memcmp(magic, "QTR3", 4) ||
+      fread(&crc, sizeof(crc), 1, f) != 1) {
+    fprintf(stderr, "qtrace_replay: %s: not a query trace\n", tracefile);
+    if (f) fclose(f);
+    return; }
+
+  if (crc != map->crc32c) {
+    fprintf(stderr, "qtrace_replay: %s: recorded on map %08x, not this map %08x\n",
+      tracefile, crc, map->crc32c);
+    fclose(f);
+    return; }
+
+  // Whole trace in memory first so threads only run queries.
+  // Smallest record is type, time, 3 floats and result.
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 8, SEEK_SET);
+  queries = (qtrace_t *)xmalloc((size/25+1)*sizeof(qtrace_t));
+  for (numqueries=0; qtrace_read(f, &queries[numqueries]); numqueries++);
+  fclose(f);
+
+  if (numthreads <= 0) numthreads = bsp_numthreads();
+  if (numthreads > BSP_MAXTHREADS) numthreads = BSP_MAXTHREADS;
+  if (numthreads > numqueries) numthreads = numqueries;
+  if (numthreads < 1) numthreads = 1;
+
+  jobs = (replayjob_t *)xmalloc(numthreads*sizeof(replayjob_t));
+  memset(jobs, 0, numthreads*sizeof(replayjob_t));
+  for (first=0, i=0; i < numthreads; i++) {
+    jobs[i].map = map;
+    jobs[i].queries = queries + first;
+    jobs[i].numqueries = (numqueries - first) / (numthreads - i);
+    first += jobs[i].numqueries; }
+
+  // Don't record the replay itself
+  recording = qtrace_file;
+  qtrace_file = NULL;
+
+  start = bsp_seconds();
+  bsp_run_threads(replay_job, jobs, sizeof(replayjob_t), numthreads);
+  start = bsp_seconds() - start;
+
+  qtrace_file = recording;
+
+  // Merge into job 0
+  for (i=1; i < numthreads; i++) {
+    for (t=0; t < QT_NUMTYPES; t++) {
+      for (b=0; b < QT_BUCKETS; b++) jobs[0].hist[t][b] += jobs[i].hist[t][b];
+      jobs[0].count[t] += jobs[i].count[t];
+      jobs[0].mismatch[t] += jobs[i].mismatch[t];
+      jobs[0].total[t] += jobs[i].total[t]; } }
+
+  printf("replayed %d queries on %d threads in %.3f ms\n", numqueries, numthreads, start*1000);
+
+  for (t=0; t < QT_NUMTYPES; t++) {
+    if (!jobs[0].count[t]) continue;
+    printf("\n%s: %lu queries, avg %.0f ns, %lu mismatched\n",
+      qt_names[t], jobs[0].count[t], jobs[0].total[t]/jobs[0].count[t], jobs[0].mismatch[t]);
+    for (n=0, b=0; b < QT_BUCKETS; b++) {
+      if (!jobs[0].hist[t][b]) continue;
+      n += jobs[0].hist[t][b];
+      printf("  < %8lu ns %10lu  %5.1f%%\n", 1UL<<b, jobs[0].hist[t][b], 100.0*n/jobs[0].count[t]); } }
+
+  free(jobs);
+  free(queries);
+}
+
+//================================================
+// Release the BSP map from memory..
+//================================================
+void bsp_free(bsp_t *map) {
+  // Stop a recording of this map, its address may be reused
+  if (map == qtrace_map) qtrace_close();
+
+  bsp_free_visdata(map);
+  lump_release(map->entdatas);
+  lump_release(map->planes);
+  lump_release(map->vertexs);
+  lump_release(map->vis);
+  lump_release(map->nodes);
+  lump_release(map->texinfos);
+  lump_release(map->faces);
+  lump_release(map->lightdatas);
+  lump_release(map->leafs);
+  lump_release(map->leaffaces);
+  lump_release(map->leafbrushes);
+  lump_release(map->edges);
+  lump_release(map->surfedges);
+  lump_release(map->models);
+  lump_release(map->brushes);
+  lump_release(map->brushsides);
+  lump_release(map->pops);
+  lump_release(map->areas);
+  lump_release(map->areaportals);
+  free(map);
+}
+
+//=================================================
+// Evict filepath from the OS file cache so the next
+// read comes from disk. Only clean pages of local
+// files can be dropped this way.
+//=================================================
+static void bsp_drop_cache(char *filepath) {
+#ifdef _WIN32
+HANDLE f;
+
+  // Opening unbuffered purges the file's cached pages
+  f = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+    FILE_FLAG_NO_BUFFERING, NULL);
+  if (f != INVALID_HANDLE_VALUE) CloseHandle(f);
+#else
+int fd;
+
+  fd = open(filepath, O_RDONLY);
+  if (fd < 0) return;
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  close(fd);
+#endif
+}
+
+// Per-map completion times of a pipeline run
+typedef struct {
+  double  last;
+  double *times;
+  int     num;
+} benchtimes_t;
+
+static void bench_free(char *filepath, bsp_t *map, void *userdata) {
+benchtimes_t *bt = (benchtimes_t *)userdata;
+double now;
+
+  (void)filepath;
+  now = bsp_seconds();
+  bt->times[bt->num++] = now - bt->last;
+  bt->last = now;
+  if (map) bsp_free(map);
+}
+
+//=================================================
+// Time loading a map list with loadbsp() one at a
+// time against loadbsp_pipeline(). Caches are dropped
+// before each pass and the order alternates between
+// rounds, so neither path runs on the other's warm
+// cache. Prints per map and total times.
+//=================================================
+void bench_load(char **filepaths, int numfiles) {
+benchtimes_t bt;
+double *sync, *piped, start, t, tsync, tpiped;
+bsp_t *map;
+int round, i;
+
+  sync = (double *)xmalloc((numfiles+1)*sizeof(double));
+  piped = (double *)xmalloc((numfiles+1)*sizeof(double));
+  bt.times = (double *)xmalloc((numfiles+1)*sizeof(double));
+  memset(sync, 0, (numfiles+1)*sizeof(double));
+  memset(piped, 0, (numfiles+1)*sizeof(double));
+  tsync = tpiped = 0;
+
+  for (round=0; round < 2; round++) {
+    for (i=0; i < numfiles; i++) bsp_drop_cache(filepaths[i]);
+
+    if (round == 0) {
+      start = bsp_seconds();
+      for (i=0; i < numfiles; i++) {
+        t = bsp_seconds();
+        map = loadbsp(filepaths[i]);
+        if (map) bsp_free(map);
+        sync[i] += bsp_seconds() - t; }
+      tsync += bsp_seconds() - start; }
+
+    for (i=0; i < numfiles; i++) bsp_drop_cache(filepaths[i]);
+
+    bt.num = 0;
+    bt.last = start = bsp_seconds();
+    loadbsp_pipeline(filepaths, numfiles, bench_free, &bt);
+    tpiped += bsp_seconds() - start;
+    for (i=0; i < numfiles; i++) piped[i] += bt.times[i];
+
+    if (round == 1) {
+      for (i=0; i < numfiles; i++) bsp_drop_cache(filepaths[i]);
+      start = bsp_seconds();
+      for (i=0; i < numfiles; i++) {
+        t = bsp_seconds();
+        map = loadbsp(filepaths[i]);
+        if (map) bsp_free(map);
+        sync[i] += bsp_seconds() - t; }
+      tsync += bsp_seconds() - start; } }
+
+  // Averages of both rounds
+  printf("\n%10s %10s  map\n", "loadbsp", "pipeline");
+  for (i=0; i < numfiles; i++)
+    printf("%7.3f ms %7.3f ms  %s\n", sync[i]*500, piped[i]*500, filepaths[i]);
+  printf("%7.3f ms %7.3f ms  total for %d maps\n", tsync*500, tpiped*500, numfiles);
+
+  free(sync);
+  free(piped);
+  free(bt.times);
+}
+
+//=================================================
+int main(int argc, char *argv[]) {
+char t;
+bsp_t *map;
+
+  // readbsp -bench map.bsp ...
+  if (argc > 2 && !strcmp(argv[1], "-bench")) {
+    bench_load(argv+2, argc-2);
+    return 0; }
+
+  // readbsp -replay map.bsp trace.qtr [-threads N]
+  if (argc > 3 && !strcmp(argv[1], "-replay")) {
+    map = loadbsp(argv[2]);
+    if (!map) return 1;
+    qtrace_replay(map, argv[3], argc > 5 && !strcmp(argv[4], "-threads") ? atoi(argv[5]) : 1);
+    bsp_free(map);
+    return 0; }
 
   map = loadbsp("c:\\quake2\\baseq2\\maps\\chaosdm1.bsp");
 